@@ -0,0 +1,271 @@
+#pragma once
+#include "error_handling.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+#include <glm/glm.hpp>
+#include <vector>
+using namespace glm;
+
+struct BVH_Item {
+  vec3 min, max;
+  // Stored in the leaves, on_leaf gets these
+  u32 id;
+};
+
+// Flattened node, 32 bytes so two siblings share a cache line
+// Inner node: count == 0, children are at [offset] and [offset + 1]
+// Leaf: item ids are BVH::ids[offset .. offset + count]
+struct BVH_Node {
+  vec3 min;
+  u32 offset;
+  vec3 max;
+  u32 count;
+};
+static_assert(sizeof(BVH_Node) == 32, "BVH_Node must match kernel.ispc");
+
+// Bounding Volume Hierarchy
+// Binned SAH builder
+// https://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf
+struct BVH {
+  static const u32 BIN_COUNT = 16;
+  static const u32 MAX_LEAF_SIZE = 16;
+  static const u32 MAX_DEPTH = 64;
+  // Relative cost of a node visit to a ray-triangle test
+  static constexpr float TRAVERSAL_COST = 1.0f;
+  std::vector<BVH_Node> nodes;
+  // BVH_Item::id of the leaf items
+  std::vector<u32> ids;
+  // Index into the build items of each entry of ids, used by refit
+  std::vector<u32> item_indices;
+
+  static float get_area(vec3 const &min, vec3 const &max) {
+    vec3 dim = max - min;
+    return 2.0f * (dim.x * dim.y + dim.y * dim.z + dim.z * dim.x);
+  }
+  void build(std::vector<BVH_Item> const &items) {
+    nodes.clear();
+    ids.clear();
+    item_indices.clear();
+    if (items.empty())
+      return;
+    std::vector<vec3> centroids(items.size());
+    ids.resize(items.size());
+    ito(items.size()) {
+      centroids[i] = (items[i].min + items[i].max) * 0.5f;
+      ids[i] = i;
+    }
+    nodes.reserve(items.size() * 2);
+    nodes.push_back({});
+    struct Build_Task {
+      u32 node_id;
+      u32 begin, end;
+      u32 depth;
+    };
+    std::vector<Build_Task> stack;
+    stack.push_back({0, 0, u32(items.size()), 0});
+    while (!stack.empty()) {
+      auto task = stack.back();
+      stack.pop_back();
+      vec3 min(FLT_MAX), max(-FLT_MAX);
+      vec3 cmin(FLT_MAX), cmax(-FLT_MAX);
+      for (u32 i = task.begin; i < task.end; i++) {
+        auto const &item = items[ids[i]];
+        min = glm::min(min, item.min);
+        max = glm::max(max, item.max);
+        cmin = glm::min(cmin, centroids[ids[i]]);
+        cmax = glm::max(cmax, centroids[ids[i]]);
+      }
+      auto &node = nodes[task.node_id];
+      node.min = min;
+      node.max = max;
+      u32 count = task.end - task.begin;
+      auto make_leaf = [&] {
+        node.offset = task.begin;
+        node.count = count;
+      };
+      if (count == 1 || task.depth == MAX_DEPTH) {
+        make_leaf();
+        continue;
+      }
+      // Find the best split among all axes
+      float best_cost = FLT_MAX;
+      u32 best_axis = 0;
+      u32 best_split = 0;
+      vec3 cdim = cmax - cmin;
+      ito(3) {
+        if (cdim[i] < 1.0e-7f)
+          continue;
+        struct Bin {
+          vec3 min = vec3(FLT_MAX), max = vec3(-FLT_MAX);
+          u32 count = 0;
+        } bins[BIN_COUNT];
+        float scale = float(BIN_COUNT) / cdim[i];
+        for (u32 j = task.begin; j < task.end; j++) {
+          auto const &item = items[ids[j]];
+          u32 bin_id = std::min(
+              BIN_COUNT - 1, u32((centroids[ids[j]][i] - cmin[i]) * scale));
+          bins[bin_id].min = glm::min(bins[bin_id].min, item.min);
+          bins[bin_id].max = glm::max(bins[bin_id].max, item.max);
+          bins[bin_id].count++;
+        }
+        // Sweep from the right to get the suffix areas
+        float right_area[BIN_COUNT];
+        u32 right_count[BIN_COUNT];
+        {
+          vec3 rmin(FLT_MAX), rmax(-FLT_MAX);
+          u32 rcount = 0;
+          for (u32 j = BIN_COUNT - 1; j > 0; j--) {
+            rmin = glm::min(rmin, bins[j].min);
+            rmax = glm::max(rmax, bins[j].max);
+            rcount += bins[j].count;
+            right_area[j] = rcount ? get_area(rmin, rmax) : 0.0f;
+            right_count[j] = rcount;
+          }
+        }
+        vec3 lmin(FLT_MAX), lmax(-FLT_MAX);
+        u32 lcount = 0;
+        for (u32 j = 0; j < BIN_COUNT - 1; j++) {
+          lmin = glm::min(lmin, bins[j].min);
+          lmax = glm::max(lmax, bins[j].max);
+          lcount += bins[j].count;
+          if (lcount == 0 || right_count[j + 1] == 0)
+            continue;
+          float cost = get_area(lmin, lmax) * float(lcount) +
+                       right_area[j + 1] * float(right_count[j + 1]);
+          if (cost < best_cost) {
+            best_cost = cost;
+            best_axis = i;
+            best_split = j + 1;
+          }
+        }
+      }
+      float parent_area = get_area(min, max);
+      float leaf_cost = float(count);
+      float split_cost = TRAVERSAL_COST +
+                         (parent_area > 0.0f ? best_cost / parent_area : 0.0f);
+      if (count <= MAX_LEAF_SIZE &&
+          (best_cost == FLT_MAX || split_cost >= leaf_cost)) {
+        make_leaf();
+        continue;
+      }
+      u32 *mid;
+      if (best_cost == FLT_MAX) {
+        // All centroids are in one spot, split in the middle
+        mid = &ids[task.begin] + count / 2;
+      } else {
+        float scale = float(BIN_COUNT) / cdim[best_axis];
+        mid = std::partition(&ids[task.begin], &ids[0] + task.end,
+                             [&](u32 id) {
+                               u32 bin_id = std::min(
+                                   BIN_COUNT - 1,
+                                   u32((centroids[id][best_axis] -
+                                        cmin[best_axis]) *
+                                       scale));
+                               return bin_id < best_split;
+                             });
+      }
+      u32 split = u32(mid - &ids[0]);
+      ASSERT_PANIC(split > task.begin && split < task.end);
+      u32 left_id = nodes.size();
+      node.offset = left_id;
+      node.count = 0;
+      // @Note: node is invalidated here
+      nodes.push_back({});
+      nodes.push_back({});
+      stack.push_back({left_id + 1, split, task.end, task.depth + 1});
+      stack.push_back({left_id, task.begin, split, task.depth + 1});
+    }
+    nodes.shrink_to_fit();
+    // The build works on item indices, the leaves keep the ids
+    item_indices = ids;
+    ito(ids.size()) ids[i] = items[item_indices[i]].id;
+  }
+  // Updates the bounds keeping the topology
+  // items must be the same set that was passed to build
+  void refit(std::vector<BVH_Item> const &items) {
+    ASSERT_PANIC(items.size() == item_indices.size());
+    // Children are always stored after their parent
+    for (u32 i = nodes.size(); i-- > 0;) {
+      auto &node = nodes[i];
+      vec3 min(FLT_MAX), max(-FLT_MAX);
+      if (node.count) {
+        for (u32 j = node.offset; j < node.offset + node.count; j++) {
+          min = glm::min(min, items[item_indices[j]].min);
+          max = glm::max(max, items[item_indices[j]].max);
+        }
+      } else {
+        ito(2) {
+          min = glm::min(min, nodes[node.offset + i].min);
+          max = glm::max(max, nodes[node.offset + i].max);
+        }
+      }
+      node.min = min;
+      node.max = max;
+    }
+  }
+  static bool intersect_box(vec3 const &min, vec3 const &max, vec3 ray_invdir,
+                            vec3 ray_origin, float &hit_min, float &hit_max) {
+    vec3 tbot = ray_invdir * (min - ray_origin);
+    vec3 ttop = ray_invdir * (max - ray_origin);
+    vec3 tmin = glm::min(ttop, tbot);
+    vec3 tmax = glm::max(ttop, tbot);
+    hit_min = std::max(tmin.x, std::max(tmin.y, tmin.z));
+    hit_max = std::min(tmax.x, std::min(tmax.y, tmax.z));
+    return hit_max >= std::max(hit_min, 0.0f);
+  }
+  // on_leaf is called with the item ids of every leaf the ray enters, closest
+  // first. It updates t_max to prune farther nodes and returns false to
+  // early-out the traversal
+  void iterate(vec3 ray_dir, vec3 ray_origin,
+               std::function<bool(u32 const *, u32, float &t_max)> on_leaf,
+               float t_max = FLT_MAX) {
+    if (nodes.empty())
+      return;
+    // @Cleanup: Fix devision by zero
+    ito(3) if (std::abs(ray_dir[i]) < 1.0e-7f) ray_dir[i] =
+        (std::signbit(ray_dir[i]) ? -1.0f : 1.0f) * 1.0e-7f;
+    vec3 ray_invdir = 1.0f / ray_dir;
+    float hit_min, hit_max;
+    if (!intersect_box(nodes[0].min, nodes[0].max, ray_invdir, ray_origin,
+                       hit_min, hit_max) ||
+        hit_min > t_max)
+      return;
+    struct Stack_Entry {
+      u32 node_id;
+      float t;
+    } stack[MAX_DEPTH * 2];
+    u32 stack_ptr = 0;
+    stack[stack_ptr++] = {0, hit_min};
+    while (stack_ptr) {
+      auto entry = stack[--stack_ptr];
+      if (entry.t > t_max)
+        continue;
+      auto const &node = nodes[entry.node_id];
+      if (node.count) {
+        if (!on_leaf(&ids[node.offset], node.count, t_max))
+          return;
+        continue;
+      }
+      float t[2];
+      bool hit[2];
+      ito(2) {
+        auto const &child = nodes[node.offset + i];
+        hit[i] = intersect_box(child.min, child.max, ray_invdir, ray_origin,
+                               t[i], hit_max) &&
+                 t[i] <= t_max;
+      }
+      // Push the far child first
+      if (hit[0] && hit[1]) {
+        u32 near = t[0] <= t[1] ? 0 : 1;
+        stack[stack_ptr++] = {node.offset + 1 - near, t[1 - near]};
+        stack[stack_ptr++] = {node.offset + near, t[near]};
+      } else if (hit[0]) {
+        stack[stack_ptr++] = {node.offset, t[0]};
+      } else if (hit[1]) {
+        stack[stack_ptr++] = {node.offset + 1, t[1]};
+      }
+    }
+  }
+};
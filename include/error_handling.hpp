@@ -37,9 +37,11 @@ static void error_callback(int error, const char *description) {
 // static __inline void _mm_pause() { __asm__ __volatile__("rep; nop" : :); }
 
 // Poor man's rust
+using u8 = uint8_t;
 using u32 = uint32_t;
 using u64 = uint64_t;
 using i32 = int32_t;
+using i64 = int64_t;
 using f32 = float;
 
 #define ito(N) for (u32 i = 0; i < N; i++)
@@ -190,50 +190,6 @@ struct Gizmo_Drag_State {
   }
 };
 
-struct Camera {
-  float phi = M_PI / 2.0f;
-  float theta = M_PI / 2.0f;
-  float distance = 60.0f;
-  float mx = 0.0f, my = 0.0f;
-  vec3 look_at = vec3(0.0f, 0.0f, 0.0f);
-  float aspect = 1.0;
-  float fov = M_PI / 2.0;
-  float znear = 1.0f;
-  float zfar = 10.0e5f;
-  //
-  vec3 pos;
-  mat4 view;
-  mat4 proj;
-  vec3 look;
-  vec3 right;
-  vec3 up;
-  void update(vec2 jitter = vec2(0.0f, 0.0f)) {
-    /*-------------------*/
-    /* Update the camera */
-    /*-------------------*/
-    pos = vec3(sinf(theta) * cosf(phi), cos(theta), sinf(theta) * sinf(phi)) *
-              distance +
-          look_at;
-    look = normalize(look_at - pos);
-    right = normalize(cross(look, vec3(0.0f, 1.0f, 0.0f)));
-    up = normalize(cross(right, look));
-    //    proj = glm::perspective(fov, aspect, znear, zfar);
-    proj = mat4(0.0f);
-    float tanHalfFovy = std::tan(fov * 0.5f);
-
-    proj[0][0] = 1.0f / (aspect * tanHalfFovy);
-    proj[1][1] = 1.0f / (tanHalfFovy);
-    proj[2][2] = zfar / (znear - zfar);
-    proj[2][3] = -1.0f;
-    proj[3][2] = -(zfar * znear) / (zfar - znear);
-
-    proj[2][0] += jitter.x;
-    proj[2][1] += jitter.x;
-    view = glm::lookAt(pos, look_at, vec3(0.0f, 1.0f, 0.0f));
-  }
-  mat4 viewproj() { return proj * view; }
-};
-
 struct Gizmo_Layer {
   RAW_MOVABLE(Gizmo_Layer)
   //////////////////
@@ -9,7 +9,9 @@ PBR_Model load_gltf_pbr(std::string const &filename);
 
 Image_Raw load_image(std::string const &filename,
                      vk::Format format = vk::Format::eR8G8B8A8Unorm);
-void save_image(std::string const &filename, Image_Raw const &image);
+// Writes a PNG, or a PFM if the filename ends with .pfm
+// Returns false if the file could not be written
+bool save_image(std::string const &filename, Image_Raw const &image);
 struct LTC_Data {
   Image_Raw inv;
   Image_Raw ampl;
@@ -310,8 +310,7 @@ struct UG {
     this->max = _min + fbin_count * bin_size;
     bins.push_back({});
     this->total_bin_count = bin_count.x * bin_count.y * bin_count.z;
-    for (u32 i = 0; i < total_bin_count; i++)
-      bins_indices.push_back(0);
+    bins_indices.resize(total_bin_count, 0);
   }
   void to_bit_table(Bit_Stream &bitstream) {
 
@@ -447,6 +446,57 @@ struct UG {
   void put(vec3 const &pos, float radius, uint index) {
     put(pos, {radius, radius, radius}, index);
   }
+  // Range of cells overlapped by the box, empty when min_ids > max_ids
+  void get_cell_range(vec3 const &pos, vec3 const &extent, ivec3 &min_ids,
+                      ivec3 &max_ids) const {
+    float EPS = 1.0e-1f;
+    min_ids = ivec3((pos - min - vec3(EPS, EPS, EPS) - extent) / bin_size);
+    max_ids = ivec3((pos - min + vec3(EPS, EPS, EPS) + extent) / bin_size);
+    min_ids = glm::max(min_ids, ivec3(0));
+    max_ids = glm::min(max_ids, ivec3(bin_count) - ivec3(1));
+  }
+  // Builds the same layout as put() followed by pack() without the per cell
+  // vectors: the first pass counts the items of every cell, the second one
+  // writes them straight into the arena
+  // get_box(i, pos, extent) returns the bounds of item i
+  template <typename Box_Func>
+  Packed_UG pack_items(u32 item_count, Box_Func get_box) const {
+    Packed_UG out;
+    out.min = min;
+    out.max = max;
+    out.bin_count = bin_count;
+    out.bin_size = bin_size;
+    out.arena_table.resize(total_bin_count * 2, 0);
+    auto for_each_cell = [&](u32 item_id, auto on_cell) {
+      vec3 pos, extent;
+      get_box(item_id, pos, extent);
+      ivec3 min_ids, max_ids;
+      get_cell_range(pos, extent, min_ids, max_ids);
+      for (int iz = min_ids.z; iz <= max_ids.z; iz++)
+        for (int iy = min_ids.y; iy <= max_ids.y; iy++)
+          for (int ix = min_ids.x; ix <= max_ids.x; ix++)
+            on_cell(ix + iy * bin_count.x + iz * bin_count.x * bin_count.y);
+    };
+    // Count, the counters live in the size slots of arena_table
+    ito(item_count) for_each_cell(
+        i, [&](u32 flat_id) { out.arena_table[flat_id * 2 + 1]++; });
+    // Offsets, ids[0] is reserved so that 0 means an empty cell
+    u32 offset = 1;
+    ito(total_bin_count) {
+      u32 count = out.arena_table[i * 2 + 1];
+      out.arena_table[i * 2] = count ? offset : 0;
+      offset += count;
+    }
+    out.ids.resize(offset);
+    out.ids[0] = 0;
+    // Scatter, the size slots are the cursors and end up as the counts again
+    ito(total_bin_count) out.arena_table[i * 2 + 1] = 0;
+    ito(item_count) for_each_cell(i, [&](u32 flat_id) {
+      out.ids[out.arena_table[flat_id * 2] +
+              out.arena_table[flat_id * 2 + 1]++] = i;
+    });
+    return out;
+  }
   void put(vec3 const &pos, vec3 const &extent, uint index) {
     float EPS = 1.0e-1f;
     //    if (pos.x > this->max.x + extent.x * (1.0f + EPS) ||
@@ -483,7 +533,7 @@ struct UG {
     }
   }
   bool intersect_box(vec3 ray_invdir, vec3 ray_origin, float &hit_min,
-                     float &hit_max) {
+                     float &hit_max) const {
     vec3 tbot = ray_invdir * (this->min - ray_origin);
     vec3 ttop = ray_invdir * (this->max - ray_origin);
     vec3 tmin = glm::min(ttop, tbot);
@@ -500,6 +550,18 @@ struct UG {
   void
   iterate(vec3 ray_dir, vec3 ray_origin,
           std::function<bool(std::vector<u32> const &, float t_max)> on_hit) {
+    iterate_cells(ray_dir, ray_origin, [&](u32 flat_id, float t_max) {
+      uint bin_offset = this->bins_indices[flat_id];
+      // If the current node has items
+      if (bin_offset > 0)
+        return on_hit(this->bins[bin_offset], t_max);
+      return true;
+    });
+  }
+  // Visits the cells along the ray in order
+  // on_cell gets the flat cell id and returns false to early-out
+  void iterate_cells(vec3 ray_dir, vec3 ray_origin,
+                     std::function<bool(u32, float t_max)> on_cell) const {
           // @Cleanup: Fix devision by zero
     ito(3) if (std::abs(ray_dir[i]) < 1.0e-7f) ray_dir[i] =
         (std::signbit(ray_dir[i]) ? -1.0f : 1.0f) * 1.0e-7f;
@@ -546,14 +608,8 @@ struct UG {
       float t_max = axis_distance[axis];
       uint cell_id_offset = cell_id[2] * bin_count[0] * bin_count[1] +
                             cell_id[1] * bin_count[0] + cell_id[0];
-      uint o = cell_id_offset;
-      uint bin_offset = this->bins_indices[o];
-      // If the current node has items
-      if (bin_offset > 0) {
-        if (!on_hit(this->bins[bin_offset],
-                    (t_max + hit_min) * (1.0f + 1.0e-5f)))
-          return;
-      }
+      if (!on_cell(cell_id_offset, (t_max + hit_min) * (1.0f + 1.0e-5f)))
+        return;
       axis_distance[axis] += axis_delta[axis];
       cell_id[axis] += cell_delta[axis];
       if (cell_id[axis] < 0 || cell_id[axis] >= bin_count[axis])
@@ -596,6 +652,18 @@ struct UG {
 }
 ;
 void fill_lines_render(std::vector<vec3> &lines) {
+  fill_lines_render(lines, [this](u32 flat_id) {
+    return this->bins_indices[flat_id] != 0;
+  });
+}
+// For grids built with pack_items, the cells only live in packed
+void fill_lines_render(std::vector<vec3> &lines, Packed_UG const &packed) {
+  fill_lines_render(lines, [&packed](u32 flat_id) {
+    return packed.arena_table[flat_id * 2 + 1] != 0;
+  });
+}
+void fill_lines_render(std::vector<vec3> &lines,
+                       std::function<bool(u32)> is_occupied) {
 
   push_cube(lines, min.x, min.y, min.z, max.x - min.x, max.y - min.y,
             max.z - min.z);
@@ -604,8 +672,7 @@ void fill_lines_render(std::vector<vec3> &lines) {
       for (int dz = 0; dz < bin_count.z; dz++) {
         const auto flat_id = dx + dy * this->bin_count.x +
                              dz * this->bin_count.x * this->bin_count.y;
-        const auto bin_id = this->bins_indices[flat_id];
-        if (bin_id != 0) {
+        if (is_occupied(flat_id)) {
           const auto bin_idx = bin_size * f32(dx) + this->min.x;
           const auto bin_idy = bin_size * f32(dy) + this->min.y;
           const auto bin_idz = bin_size * f32(dz) + this->min.z;
@@ -5,13 +5,24 @@
 #include <marl/thread.h>
 #include <marl/waitgroup.h>
 
+#include "bvh.hpp"
 #include "error_handling.hpp"
-#include "gizmo.hpp"
+#include "imgui.h"
 #include "model_loader.hpp"
 #include "particle_sim.hpp"
 #include "primitives.hpp"
 #include "random.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/ext.hpp>
 #include <glm/glm.hpp>
@@ -19,20 +30,92 @@ using namespace glm;
 
 #include <oidn/include/OpenImageDenoise/oidn.hpp>
 
-struct Scene_Node {
-  u32 id;
-  u32 pbr_node_id;
-  u32 material_id;
-  mat4 transform;
-  mat4 invtransform;
+#ifdef UG_TRIANGLE_BLOCKS
+#ifndef UG_TRIANGLE_BLOCK_WIDTH
+#define UG_TRIANGLE_BLOCK_WIDTH 8
+#endif
+static_assert(UG_TRIANGLE_BLOCK_WIDTH == 4 || UG_TRIANGLE_BLOCK_WIDTH == 8,
+              "Unsupported triangle block width");
+// Precomputed edge form triangles of a uniform grid cell
+// Unused slots have zero edges and never pass the ray test
+// Must match UG_Triangle_Block in kernel.ispc
+struct UG_Triangle_Block {
+  static const u32 WIDTH = UG_TRIANGLE_BLOCK_WIDTH;
+  f32 v0[3][WIDTH];
+  f32 edge1[3][WIDTH];
+  f32 edge2[3][WIDTH];
+  u32 face_id[WIDTH];
+};
+#endif
+
+// Model space geometry and acceleration structures of a mesh
+// Shared by every Scene_Node that instances it
+struct Scene_Mesh {
   std::vector<GLRF_Vertex_Static> vertices;
   std::vector<u32_face> indices;
   std::vector<vec3> positions_flat;
   UG ug = UG(1.0f, 1.0f);
   Packed_UG packed_ug;
+#ifdef UG_TRIANGLE_BLOCKS
+  // (block_offset, block_count) for each cell of packed_ug
+  std::vector<u32> ug_block_table;
+  std::vector<UG_Triangle_Block> ug_blocks;
+  // Copies the triangles of every cell into contiguous blocks so that the
+  // grid traversal does not go through the index buffer
+  void build_ug_blocks() {
+    const u32 W = UG_Triangle_Block::WIDTH;
+    ug_block_table.clear();
+    ug_blocks.clear();
+    for (u32 cell = 0; cell < packed_ug.arena_table.size(); cell += 2) {
+      u32 offset = packed_ug.arena_table[cell];
+      u32 count = packed_ug.arena_table[cell + 1];
+      u32 block_count = (count + W - 1) / W;
+      ug_block_table.push_back(ug_blocks.size());
+      ug_block_table.push_back(block_count);
+      jto(block_count) {
+        UG_Triangle_Block block = {};
+        kto(W) {
+          block.face_id[k] = ~0u;
+          u32 item = j * W + k;
+          if (item >= count)
+            continue;
+          u32 face_id = packed_ug.ids[offset + item];
+          auto face = indices[face_id];
+          vec3 v0 = positions_flat[face.v0];
+          vec3 edge1 = positions_flat[face.v1] - v0;
+          vec3 edge2 = positions_flat[face.v2] - v0;
+          ito(3) {
+            block.v0[i][k] = v0[i];
+            block.edge1[i][k] = edge1[i];
+            block.edge2[i][k] = edge2[i];
+          }
+          block.face_id[k] = face_id;
+        }
+        ug_blocks.push_back(block);
+      }
+    }
+  }
+#endif
   Oct_Tree octree;
+  BVH bvh;
+  // Time spent in Scene::build_mesh
+  f32 build_ms = 0.0f;
+};
+
+// An instance of a Scene_Mesh
+struct Scene_Node {
+  u32 id;
+  u32 pbr_node_id;
+  u32 material_id;
+  // Index into Scene::meshes
+  u32 mesh_id;
+  mat4 transform;
+  mat4 invtransform;
 };
 
+// Per scene acceleration structure used for the ray-mesh tests
+enum class Accel_Type { UNIFORM_GRID, BVH };
+
 enum class Light_Type { POINT, DIRECTIONAL, CONE, SPHERE, PLANE };
 
 struct Point_Light {
@@ -58,6 +141,12 @@ struct Plane_Light {
   vec3 position;
   vec3 up;
   vec3 right;
+  // up and right are kept orthogonal by the light editor
+  Spherical_Rect get_spherical_rect(vec3 origin) const {
+    Spherical_Rect rect;
+    rect.init(position - up - right, 2.0f * right, 2.0f * up, origin);
+    return rect;
+  }
 };
 
 struct Light_Source {
@@ -104,15 +193,117 @@ struct Light_Source {
   }
 };
 
+// Importance sampling of the equirect spheremap
+// Piecewise constant 2D distribution over texels: a row is picked with the
+// marginal CDF, then a texel with the CDF of that row
+// http://www.pbr-book.org/3ed-2018/Light_Transport_I_Surface_Reflection/Sampling_Light_Sources.html#InfiniteAreaLights
+struct Env_Sampler {
+  u32 width = 0, height = 0;
+  // Texel luminance scaled by sin(theta)
+  std::vector<f32> func;
+  // width + 1 entries per row
+  std::vector<f32> conditional_cdf;
+  // height + 1 entries
+  std::vector<f32> marginal_cdf;
+  // Integral of func over the unit square
+  f32 integral = 0.0f;
+  bool empty() const { return integral <= 0.0f; }
+  // Same mapping that is used for the spheremap lookup on a miss
+  static vec2 dir_to_uv(vec3 dir) {
+    float theta = std::acos(glm::clamp(dir.y, -1.0f, 1.0f));
+    float phi = -std::atan2(dir.z, -dir.x);
+    return vec2(phi / TWO_PI + 0.5f, theta / PI);
+  }
+  static vec3 uv_to_dir(vec2 uv) {
+    float theta = uv.y * PI;
+    float phi = (uv.x - 0.5f) * TWO_PI;
+    float sin_theta = std::sin(theta);
+    return vec3(-std::cos(phi) * sin_theta, std::cos(theta),
+                -std::sin(phi) * sin_theta);
+  }
+  void build(Image_Raw &image) {
+    width = image.width;
+    height = image.height;
+    func.resize(width * height);
+    conditional_cdf.resize(height * (width + 1));
+    marginal_cdf.resize(height + 1);
+    ito(height) {
+      float sin_theta = std::sin(PI * (f32(i) + 0.5f) / f32(height));
+      f32 *cdf = &conditional_cdf[i * (width + 1)];
+      cdf[0] = 0.0f;
+      jto(width) {
+        vec4 texel = image.sample(
+            vec2((f32(j) + 0.5f) / f32(width), (f32(i) + 0.5f) / f32(height)));
+        f32 lum = glm::dot(vec3(texel), vec3(0.2126f, 0.7152f, 0.0722f));
+        func[i * width + j] = std::max(lum, 0.0f) * sin_theta;
+        cdf[j + 1] = cdf[j] + func[i * width + j] / f32(width);
+      }
+    }
+    marginal_cdf[0] = 0.0f;
+    ito(height) {
+      f32 row_integral = conditional_cdf[i * (width + 1) + width];
+      marginal_cdf[i + 1] = marginal_cdf[i] + row_integral / f32(height);
+    }
+    integral = marginal_cdf[height];
+  }
+  // Returns the index of the bin of a normalized CDF with n bins
+  static u32 find_bin(f32 const *cdf, u32 n, f32 x) {
+    u32 id = u32(std::upper_bound(cdf, cdf + n + 1, x * cdf[n]) - cdf);
+    return glm::clamp(id, 1u, n) - 1u;
+  }
+  // Returns the direction and its solid angle pdf
+  vec3 sample(vec2 xi, f32 &pdf) const {
+    u32 y = find_bin(&marginal_cdf[0], height, xi.y);
+    f32 const *cdf = &conditional_cdf[y * (width + 1)];
+    u32 x = find_bin(cdf, width, xi.x);
+    // Uniform within the texel
+    f32 row_sum = cdf[width];
+    f32 dx = cdf[x + 1] - cdf[x];
+    f32 fx = dx > 0.0f ? (xi.x * row_sum - cdf[x]) / dx : 0.5f;
+    f32 dy = marginal_cdf[y + 1] - marginal_cdf[y];
+    f32 fy = dy > 0.0f ? (xi.y * integral - marginal_cdf[y]) / dy : 0.5f;
+    vec2 uv = vec2((f32(x) + glm::clamp(fx, 0.0f, 1.0f)) / f32(width),
+                   (f32(y) + glm::clamp(fy, 0.0f, 1.0f)) / f32(height));
+    pdf = get_pdf(uv);
+    return uv_to_dir(uv);
+  }
+  f32 get_pdf(vec2 uv) const {
+    float sin_theta = std::sin(uv.y * PI);
+    if (sin_theta <= 0.0f || empty())
+      return 0.0f;
+    u32 x = std::min(u32(uv.x * f32(width)), width - 1);
+    u32 y = std::min(u32(uv.y * f32(height)), height - 1);
+    // du dv = dw / (2 pi^2 sin(theta))
+    return func[y * width + x] / integral / (2.0f * PI * PI * sin_theta);
+  }
+  f32 get_pdf(vec3 dir) const { return get_pdf(dir_to_uv(dir)); }
+};
+
 struct Scene {
   RAW_MOVABLE(Scene);
   Image_Raw spheremap;
+  Env_Sampler env_sampler;
   PBR_Model pbr_model;
+  // Decoded copies of pbr_model.images used by the shading stage
+  std::vector<Shading_Texture> textures;
+  // One entry per pbr_model mesh
+  std::vector<Scene_Mesh> meshes;
   std::vector<Scene_Node> scene_nodes;
   std::vector<Light_Source> light_sources;
+  Accel_Type accel_type = Accel_Type::UNIFORM_GRID;
+  // Nothing traces against the octree, it is only built on request
+  bool build_octree = false;
+  // Wall time of the per node builds of the last load_model
+  f32 accel_build_ms = 0.0f;
+  // Top level BVH over world space bounds of scene_nodes
+  // Leaf items are indices into scene_nodes
+  BVH tlas;
   void reset_model() {
     pbr_model = PBR_Model{};
+    textures.clear();
+    meshes.clear();
     scene_nodes.clear();
+    tlas = BVH{};
   }
   void init_black_env() {
     vec3 pixel(0.0f, 0.0f, 0.0f);
@@ -124,6 +315,7 @@ struct Scene {
     spheremap.width = 2;
     spheremap.height = 2;
     spheremap.format = vk::Format::eR32G32B32Sfloat;
+    env_sampler = Env_Sampler{};
   }
   void push_light(Light_Source const &light) { light_sources.push_back(light); }
   Light_Source &get_ligth(u32 index) { return light_sources[index]; }
@@ -143,76 +335,57 @@ struct Scene {
       snode.transform = pbr_model.nodes[snode.pbr_node_id].transform_cache;
       snode.invtransform = glm::inverse(snode.transform);
     }
+    // Moving nodes only changes the bounds
+    tlas.refit(get_tlas_items());
+  }
+  std::vector<BVH_Item> get_tlas_items() {
+    std::vector<BVH_Item> items(scene_nodes.size());
+    ito(scene_nodes.size()) {
+      auto &snode = scene_nodes[i];
+      auto &bvh = meshes[snode.mesh_id].bvh;
+      vec3 min(FLT_MAX), max(-FLT_MAX);
+      if (!bvh.nodes.empty()) {
+        // Transform the corners of the model space bounds
+        vec3 local_min = bvh.nodes[0].min;
+        vec3 local_max = bvh.nodes[0].max;
+        jto(8) {
+          vec3 corner = vec3((j & 1) ? local_max.x : local_min.x,
+                             (j & 2) ? local_max.y : local_min.y,
+                             (j & 4) ? local_max.z : local_min.z);
+          vec3 world_corner = snode.transform * vec4(corner, 1.0f);
+          min = glm::min(min, world_corner);
+          max = glm::max(max, world_corner);
+        }
+      }
+      items[i] = BVH_Item{.min = min, .max = max, .id = i};
+    }
+    return items;
   }
   void load_env(std::string const &filename) {
     spheremap = load_image(filename);
+    env_sampler.build(spheremap);
   };
   void load_model(std::string const &filename) {
     pbr_model = load_gltf_pbr(filename);
+    init_model();
+  };
+  // Instances the meshes of pbr_model and builds their acceleration
+  // structures
+  void init_model() {
     std::function<void(u32, mat4)> enter_node = [&](u32 node_id,
                                                     mat4 transform) {
       auto &node = pbr_model.nodes[node_id];
 
-      transform = node.get_transform() * transform;
+      transform = transform * node.get_transform();
       for (auto i : node.meshes) {
-        auto &mesh = pbr_model.meshes[i];
         Scene_Node snode;
         snode.pbr_node_id = node_id;
         snode.id = scene_nodes.size() + 1;
         snode.material_id = i;
+        snode.mesh_id = i;
         // @TODO: Update transform separately
         snode.transform = transform;
         snode.invtransform = glm::inverse(transform);
-        using GLRF_Vertex_t = GLRF_Vertex_Static;
-        snode.vertices.resize(mesh.attributes.size() / sizeof(GLRF_Vertex_t));
-        memcpy(&snode.vertices[0], &mesh.attributes[0], mesh.attributes.size());
-        snode.indices.resize(mesh.indices.size() / 3);
-        memcpy(&snode.indices[0], &mesh.indices[0],
-               mesh.indices.size() * sizeof(u32));
-        for (auto &vtx : snode.vertices) {
-          snode.positions_flat.push_back(vtx.position);
-        }
-        vec3 model_min(0.0f, 0.0f, 0.0f), model_max(0.0f, 0.0f, 0.0f);
-        float avg_triangle_radius = 0.0f;
-        for (auto face : snode.indices) {
-          vec3 v0 = snode.positions_flat[face.v0];
-          vec3 v1 = snode.positions_flat[face.v1];
-          vec3 v2 = snode.positions_flat[face.v2];
-          vec3 triangle_min, triangle_max;
-          get_aabb(v0, v1, v2, triangle_min, triangle_max);
-          vec3 center;
-          float radius;
-          get_center_radius(v0, v1, v2, center, radius);
-          avg_triangle_radius += radius;
-          union_aabb(triangle_min, triangle_max, model_min, model_max);
-        }
-        avg_triangle_radius /= snode.indices.size();
-        vec3 dim = model_max - model_min;
-        vec3 ug_size = model_max - model_min;
-        float smallest_dim =
-            std::min(ug_size.x, std::min(ug_size.y, ug_size.z));
-        float longest_dim = std::max(ug_size.x, std::max(ug_size.y, ug_size.z));
-        float ug_cell_size =
-            std::max((longest_dim / 128) + 0.01f,
-                     std::min(2.0f * avg_triangle_radius, longest_dim / 2));
-        snode.ug = UG(model_min, model_max, ug_cell_size);
-        snode.octree.root.reset(new Oct_Node(model_min, model_max, 0));
-        {
-          u32 triangle_id = 0;
-          for (auto face : snode.indices) {
-            vec3 v0 = snode.positions_flat[face.v0];
-            vec3 v1 = snode.positions_flat[face.v1];
-            vec3 v2 = snode.positions_flat[face.v2];
-            vec3 triangle_min, triangle_max;
-            get_aabb(v0, v1, v2, triangle_min, triangle_max);
-            snode.ug.put((triangle_min + triangle_max) * 0.5f,
-                         (triangle_max - triangle_min) * 0.5f, triangle_id);
-            snode.octree.root->push(Oct_Item{
-                .min = triangle_min, .max = triangle_max, .id = triangle_id});
-            triangle_id++;
-          }
-        }
-        snode.packed_ug = snode.ug.pack();
         scene_nodes.emplace_back(std::move(snode));
       }
 
@@ -221,12 +394,213 @@ struct Scene {
       }
     };
     enter_node(0, mat4(1.0f));
+    auto build_begin = std::chrono::high_resolution_clock::now();
+    meshes.clear();
+    meshes.resize(pbr_model.meshes.size());
+    // Biggest meshes first so that they don't end up as the tail
+    std::vector<u32> order(meshes.size());
+    ito(order.size()) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](u32 a, u32 b) {
+      return pbr_model.meshes[a].indices.size() >
+             pbr_model.meshes[b].indices.size();
+    });
+    if (marl::Scheduler::get()) {
+      marl::WaitGroup wg(order.size());
+      for (u32 mesh_id : order) {
+        marl::schedule([=] {
+          defer(wg.done());
+          build_mesh(meshes[mesh_id], pbr_model.meshes[mesh_id]);
+        });
+      }
+      wg.wait();
+    } else {
+      for (u32 mesh_id : order)
+        build_mesh(meshes[mesh_id], pbr_model.meshes[mesh_id]);
+    }
+    accel_build_ms = std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now() -
+                         build_begin)
+                         .count();
+    tlas.build(get_tlas_items());
+    init_textures();
   };
+  // Copies the mesh and builds its acceleration structures
+  // Only touches smesh so meshes can be built in parallel
+  void build_mesh(Scene_Mesh &smesh, Raw_Mesh_Opaque const &mesh) {
+    auto build_begin = std::chrono::high_resolution_clock::now();
+    using GLRF_Vertex_t = GLRF_Vertex_Static;
+    smesh.vertices.resize(mesh.attributes.size() / sizeof(GLRF_Vertex_t));
+    memcpy(&smesh.vertices[0], &mesh.attributes[0], mesh.attributes.size());
+    smesh.indices.resize(mesh.indices.size() / 3);
+    memcpy(&smesh.indices[0], &mesh.indices[0],
+           mesh.indices.size() * sizeof(u32));
+    smesh.positions_flat.resize(smesh.vertices.size());
+    ito(smesh.vertices.size()) smesh.positions_flat[i] =
+        smesh.vertices[i].position;
+    vec3 model_min(0.0f, 0.0f, 0.0f), model_max(0.0f, 0.0f, 0.0f);
+    float avg_triangle_radius = 0.0f;
+    std::vector<BVH_Item> bvh_items(smesh.indices.size());
+    ito(smesh.indices.size()) {
+      auto face = smesh.indices[i];
+      vec3 v0 = smesh.positions_flat[face.v0];
+      vec3 v1 = smesh.positions_flat[face.v1];
+      vec3 v2 = smesh.positions_flat[face.v2];
+      vec3 triangle_min, triangle_max;
+      get_aabb(v0, v1, v2, triangle_min, triangle_max);
+      vec3 center;
+      float radius;
+      get_center_radius(v0, v1, v2, center, radius);
+      avg_triangle_radius += radius;
+      union_aabb(triangle_min, triangle_max, model_min, model_max);
+      bvh_items[i] =
+          BVH_Item{.min = triangle_min, .max = triangle_max, .id = i};
+    }
+    avg_triangle_radius /= smesh.indices.size();
+    vec3 ug_size = model_max - model_min;
+    float longest_dim = std::max(ug_size.x, std::max(ug_size.y, ug_size.z));
+    float ug_cell_size =
+        std::max((longest_dim / 128) + 0.01f,
+                 std::min(2.0f * avg_triangle_radius, longest_dim / 2));
+    smesh.ug = UG(model_min, model_max, ug_cell_size);
+    smesh.packed_ug =
+        smesh.ug.pack_items(bvh_items.size(), [&](u32 i, vec3 &pos,
+                                                  vec3 &extent) {
+          pos = (bvh_items[i].min + bvh_items[i].max) * 0.5f;
+          extent = (bvh_items[i].max - bvh_items[i].min) * 0.5f;
+        });
+#ifdef UG_TRIANGLE_BLOCKS
+    smesh.build_ug_blocks();
+#endif
+    if (build_octree) {
+      smesh.octree.root.reset(new Oct_Node(model_min, model_max, 0));
+      for (auto const &item : bvh_items)
+        smesh.octree.root->push(
+            Oct_Item{.min = item.min, .max = item.max, .id = item.id});
+    }
+    smesh.bvh.build(bvh_items);
+    smesh.build_ms = std::chrono::duration<float, std::milli>(
+                         std::chrono::high_resolution_clock::now() -
+                         build_begin)
+                         .count();
+  }
+  void init_textures() {
+    textures.clear();
+    textures.resize(pbr_model.images.size());
+    // Same as the mesh builds: one task per image on the scheduler
+    if (marl::Scheduler::get()) {
+      marl::WaitGroup wg(textures.size());
+      ito(textures.size()) {
+        marl::schedule([=] {
+          defer(wg.done());
+          textures[i].init(pbr_model.images[i]);
+        });
+      }
+      wg.wait();
+    } else {
+      ito(textures.size()) textures[i].init(pbr_model.images[i]);
+    }
+  }
+  // Ray cone texture lod for a unit sized texture
+  // Texture Level of Detail Strategies for Real-Time Ray Tracing, ch. 20 of
+  // Ray Tracing Gems
+  f32 get_texture_lod(Scene_Node &node, u32 face_id, vec3 ray_dir,
+                      f32 cone_width) {
+    auto &mesh = meshes[node.mesh_id];
+    auto face = mesh.indices[face_id];
+    auto &v0 = mesh.vertices[face.v0];
+    auto &v1 = mesh.vertices[face.v1];
+    auto &v2 = mesh.vertices[face.v2];
+    vec3 p0 = node.transform * vec4(v0.position, 1.0f);
+    vec3 p1 = node.transform * vec4(v1.position, 1.0f);
+    vec3 p2 = node.transform * vec4(v2.position, 1.0f);
+    vec3 cross_p = glm::cross(p1 - p0, p2 - p0);
+    vec2 t10 = v1.texcoord - v0.texcoord;
+    vec2 t20 = v2.texcoord - v0.texcoord;
+    f32 ta = std::abs(t10.x * t20.y - t10.y * t20.x);
+    f32 pa = glm::length(cross_p);
+    f32 cos_theta = std::abs(glm::dot(ray_dir, cross_p)) / (pa + 1.0e-20f);
+    // Finest level
+    if (ta <= 0.0f || pa <= 0.0f || cone_width <= 0.0f)
+      return -FLT_MAX;
+    return 0.5f * std::log2(ta / pa) +
+           std::log2(cone_width / std::max(cos_theta, 1.0e-3f));
+  }
+  // Scalar reference path
+  // Finds the closest hit with the scene in world space
+  bool intersect(vec3 ray_origin, vec3 ray_dir, Collision &min_col) {
+    bool col_found = false;
+    tlas.iterate(
+        ray_dir, ray_origin,
+        [&](u32 const *items, u32 count, float &t_max) {
+          ito(count) {
+            if (intersect_node(scene_nodes[items[i]], ray_origin, ray_dir,
+                               min_col)) {
+              col_found = true;
+              t_max = min_col.t;
+            }
+          }
+          return true;
+        },
+        min_col.t);
+    return col_found;
+  }
+  // Finds the closest hit with the node in world space
+  bool intersect_node(Scene_Node &node, vec3 ray_origin, vec3 ray_dir,
+                      Collision &min_col) {
+    bool col_found = false;
+    vec3 new_ray_dir = node.invtransform * vec4(ray_dir, 0.0f);
+    vec3 new_ray_origin = node.invtransform * vec4(ray_origin, 1.0f);
+    auto &mesh = meshes[node.mesh_id];
+    // Tests a face and keeps the hit if it is closer than t_max
+    auto test_face = [&](u32 face_id, float t_max) {
+      auto face = mesh.indices[face_id];
+      vec3 v0 = mesh.positions_flat[face.v0];
+      vec3 v1 = mesh.positions_flat[face.v1];
+      vec3 v2 = mesh.positions_flat[face.v2];
+      Collision col = {};
+      if (ray_triangle_test_woop(new_ray_origin, new_ray_dir, v0, v1, v2,
+                                 col) &&
+          col.t < min_col.t && col.t < t_max) {
+        col.mesh_id = node.id;
+        col.face_id = face_id;
+        min_col = col;
+        col_found = true;
+        return true;
+      }
+      return false;
+    };
+    if (accel_type == Accel_Type::BVH) {
+      mesh.bvh.iterate(
+          new_ray_dir, new_ray_origin,
+          [&](u32 const *items, u32 count, float &t_max) {
+            ito(count) {
+              if (test_face(items[i], t_max))
+                t_max = min_col.t;
+            }
+            return true;
+          },
+          min_col.t);
+    } else {
+      // The cells only live in the packed layout
+      auto &packed_ug = mesh.packed_ug;
+      mesh.ug.iterate_cells(
+          new_ray_dir, new_ray_origin, [&](u32 flat_id, float t_max) {
+            u32 offset = packed_ug.arena_table[flat_id * 2];
+            u32 count = packed_ug.arena_table[flat_id * 2 + 1];
+            bool any_hit = false;
+            for (u32 i = offset; i < offset + count; i++)
+              any_hit |= test_face(packed_ug.ids[i], t_max);
+            return !any_hit;
+          });
+    }
+    return col_found;
+  }
   auto get_interpolated_vertex(Scene_Node &node, u32 face_id, vec2 uv) {
-    auto face = node.indices[face_id];
-    auto v0 = node.vertices[face.v0];
-    auto v1 = node.vertices[face.v1];
-    auto v2 = node.vertices[face.v2];
+    auto &mesh = meshes[node.mesh_id];
+    auto face = mesh.indices[face_id];
+    auto v0 = mesh.vertices[face.v0];
+    auto v1 = mesh.vertices[face.v1];
+    auto v2 = mesh.vertices[face.v2];
     float k1 = uv.x;
     float k2 = uv.y;
     float k0 = 1.0f - uv.x - uv.y;
@@ -243,6 +617,13 @@ struct Scene {
   };
 };
 
+// Structure of arrays view of the rays in a stream
+struct ISPC_Packed_Rays {
+  float *origin[3];
+  float *dir[3];
+  // Max distance for occlusion queries
+  float *t_max;
+};
 struct ISPC_Packed_UG {
   float invtransform[16];
   uint *bins_indices;
@@ -251,19 +632,134 @@ struct ISPC_Packed_UG {
   uint bin_count[3];
   float bin_size;
   uint mesh_id;
+#ifdef UG_TRIANGLE_BLOCKS
+  uint *block_table;
+  UG_Triangle_Block *blocks;
+#endif
 };
 extern "C" void ispc_trace(ISPC_Packed_UG *ug, void *vertices, uint *faces,
-                           vec3 *ray_dir, vec3 *ray_origin,
-                           Collision *out_collision, uint *ray_count);
+                           ISPC_Packed_Rays *rays, Collision *out_collision,
+                           uint *ray_count);
+struct ISPC_Packed_BVH {
+  float invtransform[16];
+  BVH_Node *nodes;
+  uint *ids;
+  uint mesh_id;
+};
+struct ISPC_Packed_Instance {
+  // Must match Accel_Type
+  uint accel_type;
+  ISPC_Packed_UG ug;
+  ISPC_Packed_BVH bvh;
+  void *vertices;
+  uint *faces;
+};
+// Traverses the top level BVH and tests only the instances whose bounds the
+// ray enters
+extern "C" void ispc_trace_scene(BVH_Node *tlas_nodes, uint *tlas_ids,
+                                 ISPC_Packed_Instance *instances,
+                                 ISPC_Packed_Rays *rays,
+                                 Collision *out_collision, uint *ray_count);
+// Same as ispc_trace_scene with the gang traversing as a packet
+// Only pays off for coherent rays
+extern "C" void ispc_trace_scene_packets(BVH_Node *tlas_nodes, uint *tlas_ids,
+                                         ISPC_Packed_Instance *instances,
+                                         ISPC_Packed_Rays *rays,
+                                         Collision *out_collision,
+                                         uint *ray_count);
+// Any hit query up to rays->t_max
+// out_collision[i].mesh_id is 0 when the ray is not occluded
+extern "C" void ispc_occluded(BVH_Node *tlas_nodes, uint *tlas_ids,
+                              ISPC_Packed_Instance *instances,
+                              ISPC_Packed_Rays *rays, Collision *out_collision,
+                              uint *ray_count);
+static ISPC_Packed_Instance ispc_pack_instance(Scene_Node &node,
+                                               Scene_Mesh &mesh,
+                                               Accel_Type accel_type) {
+  ISPC_Packed_Instance instance = {};
+  instance.accel_type = (uint)accel_type;
+  instance.vertices = (void *)&mesh.positions_flat[0];
+  instance.faces = (uint *)&mesh.indices[0];
+  if (accel_type == Accel_Type::BVH) {
+    auto &ispc_packed_bvh = instance.bvh;
+    ispc_packed_bvh.nodes = &mesh.bvh.nodes[0];
+    ispc_packed_bvh.ids = &mesh.bvh.ids[0];
+    memcpy(ispc_packed_bvh.invtransform,
+           &glm::transpose(node.invtransform)[0][0], 64);
+    ispc_packed_bvh.mesh_id = node.id;
+  } else {
+    auto &ispc_packed_ug = instance.ug;
+    ispc_packed_ug.ids = &mesh.packed_ug.ids[0];
+    ispc_packed_ug.bins_indices = &mesh.packed_ug.arena_table[0];
+    memcpy(ispc_packed_ug._min, &mesh.packed_ug.min, 12);
+    memcpy(ispc_packed_ug._max, &mesh.packed_ug.max, 12);
+    memcpy(ispc_packed_ug.invtransform,
+           &glm::transpose(node.invtransform)[0][0], 64);
+    memcpy(ispc_packed_ug.bin_count, &mesh.packed_ug.bin_count, 12);
+    ispc_packed_ug.bin_size = mesh.packed_ug.bin_size;
+    ispc_packed_ug.mesh_id = node.id;
+#ifdef UG_TRIANGLE_BLOCKS
+    ispc_packed_ug.block_table = &mesh.ug_block_table[0];
+    ispc_packed_ug.blocks = mesh.ug_blocks.data();
+#endif
+  }
+  return instance;
+}
 extern "C" void ispc_trace_plane(
     // Light id
     uint *id,
     // light position, up, dir and right vectors
     vec3 *p_pos, vec3 *p_dir, vec3 *p_up, vec3 *p_right,
     // Normalized ray direction and world space ray origin
-    vec3 *ray_dirs, vec3 *ray_origins,
+    ISPC_Packed_Rays *rays,
     // An array of collisions to write to
     Collision *out_collision, uint *ray_count);
+// Structure of arrays view of a Surface_Batch
+// Must match Packed_Surfaces in kernel.ispc
+struct ISPC_Packed_Surfaces {
+  float *normal[3];
+  float *tangent[3];
+  float *binormal[3];
+  float *view[3];
+  float *albedo[3];
+  float *normal_map[3];
+  float *roughness;
+  float *metalness;
+  float *xi[2];
+  float *lobe_u;
+  float *shading_normal[3];
+  float *ks;
+  uint *lobe;
+  float *dir[3];
+  float *throughput[3];
+  float *pdf;
+  float *position[3];
+  float *path_color[3];
+  float *cone_spread;
+  float *origin[3];
+  float *color[3];
+  float *spread;
+  float *nov;
+  float *f0[3];
+};
+// Normal mapping, lobe selection, BSDF sampling and the continuation ray of
+// a batch of hits
+extern "C" void ispc_shade_surfaces(ISPC_Packed_Surfaces *surfaces,
+                                    uint *count);
+// Structure of arrays view of a Light_Ray_Batch
+// Must match Packed_Light_Rays in kernel.ispc
+struct ISPC_Packed_Light_Rays {
+  uint *surface;
+  uint *kind;
+  float *dir[3];
+  float *scale;
+  float *env_pdf;
+  float *color[3];
+};
+// BSDF weights of the light rays of a batch of shaded hits
+extern "C" void ispc_eval_light_rays(ISPC_Packed_Surfaces *surfaces,
+                                     ISPC_Packed_Light_Rays *rays,
+                                     uint *count);
 struct JobDesc {
   uint offset, size;
 };
@@ -279,14 +775,95 @@ using WorkPayload = std::vector<JobPayload>;
 
 struct PT_Manager {
   u32 samples_per_pixel = 64;
-  u32 max_depth = 2;
+  // Russian roulette keeps the average path length well below that
+  u32 max_depth = 4;
   bool trace_ispc = true;
-  u32 jobs_per_item = 8 * 32 * 1000;
   bool use_jobs = true;
   u32 max_jobs_per_iter = 16 * 16 * 32 * 1000;
+  // Cap on queued jobs. Camera tiles are generated up to half of it, the
+  // other half is room for the rays that shading spawns: a step only takes
+  // as many jobs as can be shaded without going over the cap
+  u32 max_queue_size = 1 << 23;
+  // Measured wall time of a job, sizes the steps of
+  // path_tracing_iteration_budgeted
+  f32 ms_per_job = 0.0f;
+  // Trace and shade each stream on its own task instead of running the
+  // stages one after the other over all streams
+  bool pipeline_streams = true;
+  // Streams in flight per worker thread with pipeline_streams
+  u32 streams_per_worker = 2;
+  // Reorder rays by direction octant and origin before the trace step
+  // With pipeline_streams the streams taken during the step are sorted one
+  // by one before they are traced
+  bool sort_rays = false;
+  // Trace coherent streams with ispc_trace_scene_packets
+  bool packet_tracing = true;
+  // Only resample pixels whose error estimate is above adaptive_threshold
+  bool adaptive_sampling = false;
+  f32 adaptive_threshold = 0.02f;
+  // Max primary rays of an adaptive pass, the noisiest pixels go first
+  u32 adaptive_ray_budget = 1 << 20;
+  // Full passes before the error estimate is trusted
+  u32 adaptive_min_passes = 2;
+  // Stochastically end low throughput paths past rr_min_depth bounces
+  bool russian_roulette = true;
+  u32 rr_min_depth = 2;
+  // Sample the spheremap at each bounce and MIS it with the BSDF sample
+  bool env_sampling = true;
+  // light_id of env light samples
+  static const u32 ENV_LIGHT_ID = ~0u;
+  // Send visibility rays to light_samples lights picked proportionally to
+  // their power instead of to every light
+  bool sample_lights = true;
+  u32 light_samples = 1;
+  // Run normal mapping and BSDF sampling in ispc_shade_surfaces, the scalar
+  // Surface_Batch::shade_scalar is the reference
+  bool shade_ispc = true;
 
   marl::Scheduler scheduler;
-  Random_Factory frand;
+  // Scrambles the sample sequences, the image is deterministic for a seed
+  u32 sampler_seed = 0;
+  // 2D dimensions reserved for each path segment
+  static const u32 SAMPLER_DIMENSIONS_PER_BOUNCE = 256;
+  // Decorrelated per pixel sequence, dimension 0 is the pixel jitter and
+  // shading at a segment starts at (_depth + 1) *
+  // SAMPLER_DIMENSIONS_PER_BOUNCE
+  Path_Sampler get_sampler(u32 pixel_x, u32 pixel_y, u32 sample_id,
+                           u32 dimension) {
+    u32 seed = Sobol::hash_combine(
+        Sobol::hash_combine(Sobol::hash(sampler_seed), pixel_x), pixel_y);
+    return Path_Sampler{
+        .seed = seed, .index = sample_id, .dimension = dimension};
+  }
+  // Ray-scene test timings of the last iteration
+  // Used to compare acceleration structures on the same camera
+  struct Path_Tracing_Stats {
+    u32 traced_rays = 0;
+    // Max number of queued jobs during the last iteration
+    u64 peak_queue_size = 0;
+    // Pixels selected by the last adaptive pass
+    u32 adaptive_pixels = 0;
+    // Pixels that kept their samples in the last reprojection
+    u32 reprojected_pixels = 0;
+    // Traced rays of the last iteration by kind
+    u32 primary_rays = 0;
+    u32 secondary_rays = 0;
+    u32 shadow_rays = 0;
+    float generate_ms = 0.0f;
+    float trace_ms = 0.0f;
+    float sort_ms = 0.0f;
+    float shade_ms = 0.0f;
+    float rays_per_sec = 0.0f;
+    // Running average of rays_per_sec for each sort_rays mode
+    float avg_rays_per_sec[2] = {};
+    // Shaded path segments per camera ray during the last iteration
+    float avg_path_length = 0.0f;
+    // Paths ended by russian roulette during the last iteration
+    u32 rr_terminated = 0;
+    // Worker time spent waiting for other tasks between the start of the
+    // trace stage and the end of the shade stage, summed over the workers
+    float idle_ms = 0.0f;
+  } stats;
 
   PT_Manager() {
     scheduler.setWorkerThreadCount(marl::Thread::numLogicalCPUs());
@@ -309,6 +886,14 @@ struct PT_Manager {
     vec3 gen_ray(f32 u, f32 v) {
       return normalize(look * invtan + up * v + aspect * right * u);
     }
+    // Inverse of gen_ray, false for directions behind the camera
+    bool project(vec3 dir, vec2 &uv) const {
+      f32 z = dot(dir, look);
+      if (z < 1.0e-6f)
+        return false;
+      uv = vec2(dot(dir, right) / aspect, dot(dir, up)) * (invtan / z);
+      return true;
+    }
     vec2 get_pixel(vec3 v) {
       float z = dot(v, look);
       float x = dot(v, right);
@@ -323,36 +908,8 @@ struct PT_Manager {
     }
   } path_tracing_camera;
   void update_debug_ray(Scene &scene, vec3 ray_origin, vec3 ray_dir) {
-    bool col_found = false;
     Collision min_col{.t = 1.0e10f};
-    for (auto &node : scene.scene_nodes) {
-      vec4 new_ray_dir = node.invtransform * vec4(ray_dir, 0.0f);
-      vec4 new_ray_origin = node.invtransform * vec4(ray_origin, 1.0f);
-      node.ug.iterate(new_ray_dir, new_ray_origin,
-                      [&](std::vector<u32> const &items, float t_max) {
-                        bool any_hit = false;
-                        for (u32 face_id : items) {
-                          auto face = node.indices[face_id];
-                          vec3 v0 = node.positions_flat[face.v0];
-                          vec3 v1 = node.positions_flat[face.v1];
-                          vec3 v2 = node.positions_flat[face.v2];
-                          Collision col = {};
-
-                          if (ray_triangle_test_woop(new_ray_origin,
-                                                     new_ray_dir, v0, v1, v2,
-                                                     col)) {
-                            if (col.t < min_col.t && col.t < t_max) {
-                              col.mesh_id = node.id;
-                              col.face_id = face_id;
-                              min_col = col;
-                              col_found = any_hit = true;
-                            }
-                          }
-                        }
-
-                        return !any_hit;
-                      });
-    }
+    bool col_found = scene.intersect(ray_origin, ray_dir, min_col);
     if (col_found) {
       path_tracing_camera._debug_hit = true;
       path_tracing_camera._debug_pos = ray_origin + ray_dir * min_col.t;
@@ -360,15 +917,70 @@ struct PT_Manager {
       path_tracing_camera._debug_hit = false;
     }
   }
+  // Per pixel accumulator with atomic fixed point adds
+  // Integer addition is associative so the sum does not depend on the order
+  // the workers write in
+  struct Fixed_Point_Buffer {
+    // 20 fractional bits, leaves +-8e12 of range per channel
+    static constexpr f32 SCALE = f32(1 << 20);
+    static constexpr f32 MAX_VALUE = 1.0e6f;
+    std::unique_ptr<std::atomic<i64>[]> values;
+    u32 size = 0;
+    void init(u32 _size) {
+      size = _size;
+      values.reset(new std::atomic<i64>[size * 4]);
+      ito(size * 4) values[i].store(0, std::memory_order_relaxed);
+    }
+    void add(u32 id, vec4 val) {
+      ito(4) {
+        // Drop NaN/Inf samples instead of poisoning the pixel
+        if (!std::isfinite(val[i]))
+          return;
+      }
+      ito(4) {
+        f32 v = std::clamp(val[i], -MAX_VALUE, MAX_VALUE);
+        values[id * 4 + i].fetch_add(i64(std::round(v * SCALE)),
+                                     std::memory_order_relaxed);
+      }
+    }
+    vec4 get(u32 id) const {
+      vec4 out;
+      ito(4) out[i] =
+          f32(values[id * 4 + i].load(std::memory_order_relaxed)) / SCALE;
+      return out;
+    }
+    // Raw fixed point values, size * 4 of them
+    void copy_to(i64 *dst) const {
+      ito(size * 4) dst[i] = values[i].load(std::memory_order_relaxed);
+    }
+    void copy_from(i64 const *src) {
+      ito(size * 4) values[i].store(src[i], std::memory_order_relaxed);
+    }
+  };
   struct Path_Tracing_Image {
+    // Resolved sums, valid after resolve()
     std::vector<vec4> data;
     std::vector<vec4> normals;
     std::vector<vec4> albedo;
     std::vector<vec4> denoised_data;
+    // Sum of the odd samples only, for the two buffer error estimate
+    std::vector<vec4> odd_data;
+    // Number of primary samples generated for each pixel
+    std::vector<u32> sample_count;
+    Fixed_Point_Buffer data_acc;
+    Fixed_Point_Buffer odd_acc;
+    Fixed_Point_Buffer normals_acc;
+    Fixed_Point_Buffer albedo_acc;
+    // World space first hits, only read by the reprojection
+    Fixed_Point_Buffer positions_acc;
+    // Interpolated vertex normals of the first hits, only read by the
+    // reprojection
+    Fixed_Point_Buffer vertex_normals_acc;
     // A flag to track dirtiness
-    bool updated = false;
+    std::atomic<bool> updated = false;
+    // Set when the accumulators changed since the last resolve
+    std::atomic<bool> resolve_pending = false;
     u32 width = 0u, height = 0u;
-    std::mutex mutex;
     void init(u32 _width, u32 _height) {
       ASSERT_PANIC(_width && _height);
       width = _width;
@@ -380,82 +992,351 @@ struct PT_Manager {
       data.resize(width * height);
       normals.resize(width * height);
       albedo.resize(width * height);
+      odd_data.clear();
+      odd_data.resize(width * height);
+      sample_count.clear();
+      sample_count.resize(width * height);
+      // Drop the result of a denoise job started for the previous image
+      denoiser.wait();
+      denoiser.done = false;
+      denoised_data.clear();
+      denoised_data.resize(width * height);
+      data_acc.init(width * height);
+      odd_acc.init(width * height);
+      normals_acc.init(width * height);
+      albedo_acc.init(width * height);
+      positions_acc.init(width * height);
+      vertex_normals_acc.init(width * height);
       updated = true;
+      resolve_pending = false;
     }
-    void add_value(u32 x, u32 y, vec4 val) {
-      std::scoped_lock<std::mutex> sl(mutex);
-      updated = true;
-      data[x + y * width] += val;
+    void add_value(u32 x, u32 y, u32 sample_id, vec4 val) {
+      data_acc.add(x + y * width, val);
+      if (sample_id & 1u)
+        odd_acc.add(x + y * width, val);
+      resolve_pending.store(true, std::memory_order_relaxed);
     }
     void add_normal(u32 x, u32 y, vec3 val) {
-      std::scoped_lock<std::mutex> sl(mutex);
-      updated = true;
-      normals[x + y * width] += vec4(val, 1.0f);
+      normals_acc.add(x + y * width, vec4(val, 1.0f));
+      resolve_pending.store(true, std::memory_order_relaxed);
     }
     void add_albedo(u32 x, u32 y, vec3 val) {
-      std::scoped_lock<std::mutex> sl(mutex);
+      albedo_acc.add(x + y * width, vec4(val, 1.0f));
+      resolve_pending.store(true, std::memory_order_relaxed);
+    }
+    void add_position(u32 x, u32 y, vec3 val) {
+      positions_acc.add(x + y * width, vec4(val, 1.0f));
+    }
+    void add_vertex_normal(u32 x, u32 y, vec3 val) {
+      vertex_normals_acc.add(x + y * width, vec4(val, 1.0f));
+    }
+    // Converts the accumulators into data/normals/albedo
+    // Must not run concurrently with add_*
+    void resolve() {
+      if (!resolve_pending.exchange(false))
+        return;
+      ito(width * height) {
+        data[i] = data_acc.get(i);
+        odd_data[i] = odd_acc.get(i);
+        normals[i] = normals_acc.get(i);
+        albedo[i] = albedo_acc.get(i);
+      }
       updated = true;
-      albedo[x + y * width] += vec4(val, 1.0f);
     }
     vec4 get_value(u32 x, u32 y) { return data[x + y * width]; }
+    // Two buffer error estimate: compares the mean of the odd samples with
+    // the mean of the even ones, relative to the pixel brightness
+    // Valid after resolve()
+    f32 get_error(u32 i) {
+      vec4 odd = odd_data[i];
+      vec4 even = data[i] - odd;
+      if (odd.a < 1.0e-6f || even.a < 1.0e-6f)
+        return FLT_MAX;
+      vec3 a = vec3(odd) / odd.a;
+      vec3 b = vec3(even) / even.a;
+      vec3 diff = glm::abs(a - b);
+      vec3 sum = a + b;
+      return (diff.r + diff.g + diff.b) /
+             std::sqrt(std::max(sum.r + sum.g + sum.b, 1.0e-4f));
+    }
+    // Blue to red ramp of sample_count normalized by the max count
+    std::vector<vec4> get_sample_heatmap() {
+      std::vector<vec4> heatmap(width * height);
+      u32 max_count = 1;
+      for (u32 count : sample_count)
+        max_count = std::max(max_count, count);
+      ito(width * height) {
+        f32 t = f32(sample_count[i]) / f32(max_count);
+        vec3 color = vec3(2.0f * t - 1.0f, 1.0f - std::abs(2.0f * t - 1.0f),
+                          1.0f - 2.0f * t);
+        heatmap[i] = vec4(glm::clamp(color, vec3(0.0f), vec3(1.0f)), 1.0f);
+      }
+      return heatmap;
+    }
     static void errorCallback(void *userPtr, oidn::Error error,
                               const char *message) {
       throw std::runtime_error(message);
     }
-    void denoise() {
-      if (!updated)
-        return;
-      updated = false;
-      std::vector<vec3> tmp;
-      std::vector<vec3> tmp_normals;
-      std::vector<vec3> tmp_albedo;
-      std::vector<vec3> tmp_denoised(data.size());
-      for (auto const &pixel : data) {
-        if (pixel.a < 1.0e-6f) {
-          tmp.push_back(vec3(0.0f));
-        } else {
-          tmp.push_back(vec3(pixel) / pixel.a);
-        }
+    // Persistent OIDN state
+    // The device is created once and the filter is re-committed only when the
+    // resolution changes. Filtering runs on a background thread
+    struct Denoiser {
+      oidn::DeviceRef device;
+      oidn::FilterRef filter;
+      u32 width = 0u, height = 0u;
+      // Filter inputs, written only while no job is in flight
+      std::vector<vec3> color;
+      std::vector<vec3> normal;
+      std::vector<vec3> albedo;
+      std::vector<vec3> output;
+      // Written by the worker, swapped into denoised_data when done
+      std::vector<vec4> result;
+      std::thread thread;
+      std::atomic<bool> done = false;
+      ~Denoiser() { wait(); }
+      void wait() {
+        if (thread.joinable())
+          thread.join();
       }
-      for (auto const &pixel : normals) {
-        if (pixel.a < 1.0e-6f) {
-          tmp_normals.push_back(vec3(0.0f));
-        } else {
-          tmp_normals.push_back(vec3(pixel) / pixel.a);
+      bool busy() { return thread.joinable(); }
+      void resize(u32 _width, u32 _height) {
+        wait();
+        done = false;
+        if (!device) {
+          device = oidn::newDevice();
+          const char *errorMessage;
+          if (device.getError(errorMessage) != oidn::Error::None)
+            throw std::runtime_error(errorMessage);
+          device.setErrorFunction(errorCallback);
+          device.commit();
+          filter = device.newFilter("RT");
+          filter.set("hdr", true);
         }
+        if (width == _width && height == _height)
+          return;
+        width = _width;
+        height = _height;
+        color.resize(width * height);
+        normal.resize(width * height);
+        albedo.resize(width * height);
+        output.resize(width * height);
+        result.resize(width * height);
+        filter.setImage("color", &color[0], oidn::Format::Float3, width,
+                        height);
+        filter.setImage("normal", &normal[0], oidn::Format::Float3, width,
+                        height);
+        filter.setImage("albedo", &albedo[0], oidn::Format::Float3, width,
+                        height);
+        filter.setImage("output", &output[0], oidn::Format::Float3, width,
+                        height);
+        filter.commit();
       }
-      for (auto const &pixel : albedo) {
-        if (pixel.a < 1.0e-6f) {
-          tmp_albedo.push_back(vec3(0.0f));
-        } else {
-          tmp_albedo.push_back(vec3(pixel) / pixel.a);
-        }
+      void launch() {
+        ASSERT_PANIC(!busy());
+        thread = std::thread([this] {
+          try {
+            filter.execute();
+          } catch (std::exception const &e) {
+            std::cerr << "Denoiser: " << e.what() << "\n";
+          }
+          ito(output.size()) result[i] = vec4(output[i], 1.0f);
+          done = true;
+        });
       }
-      using namespace oidn;
-      oidn::DeviceRef device = oidn::newDevice();
-      const char *errorMessage;
-      if (device.getError(errorMessage) != oidn::Error::None)
-        throw std::runtime_error(errorMessage);
-      device.setErrorFunction(errorCallback);
-      device.commit();
-      oidn::FilterRef filter = device.newFilter("RT");
-      filter.setImage("color", &tmp[0], oidn::Format::Float3, width, height);
-      filter.setImage("normal", &tmp_normals[0], oidn::Format::Float3, width,
-                      height);
-      filter.setImage("albedo", &tmp_albedo[0], oidn::Format::Float3, width,
-                      height);
-      filter.setImage("output", &tmp_denoised[0], oidn::Format::Float3, width,
-                      height);
-      filter.set("hdr", true);
-      filter.commit();
-      filter.execute();
-      denoised_data.clear();
-      for (auto const &pixel : tmp_denoised) {
-        denoised_data.push_back(vec4(pixel, 1.0f));
+    } denoiser;
+    // Publishes the last finished denoise job and starts a new one if the
+    // image changed. Never blocks on the filter
+    void denoise() {
+      if (!width || !height)
+        return;
+      if (denoiser.width != width || denoiser.height != height)
+        denoiser.resize(width, height);
+      if (denoiser.done.exchange(false)) {
+        denoiser.wait();
+        std::swap(denoised_data, denoiser.result);
       }
+      if (denoiser.busy() || !updated.exchange(false))
+        return;
+      auto normalize_sum = [](vec4 const &pixel) {
+        return pixel.a < 1.0e-6f ? vec3(0.0f) : vec3(pixel) / pixel.a;
+      };
+      ito(width * height) {
+        denoiser.color[i] = normalize_sum(data[i]);
+        denoiser.normal[i] = normalize_sum(normals[i]);
+        denoiser.albedo[i] = normalize_sum(albedo[i]);
+      }
+      denoiser.launch();
     }
   } path_tracing_image;
 
+  // Memory mapped render checkpoint: camera, sampler state and the raw
+  // accumulators of path_tracing_image
+  // The file has two slots. A checkpoint is written into the slot that is
+  // not current and the header flips to it once the slot is synced, so a
+  // crash in the middle of a write leaves the previous checkpoint intact
+  struct Checkpoint_File {
+    static const u32 MAGIC = 0x4b435450u; // "PTCK"
+    static const u32 VERSION = 3u;
+    static const u32 NO_SLOT = ~0u;
+    // msync needs page aligned ranges, 64k covers every page size we run on
+    static const u64 ALIGNMENT = 1u << 16u;
+    static const u32 BUFFER_COUNT = 6;
+    struct Header {
+      u32 magic;
+      u32 version;
+      u32 width, height;
+      u32 current_slot;
+    };
+    struct State {
+      vec3 pos, look, up, right;
+      f32 fov, invtan, aspect;
+      u32 halton_counter;
+      u32 sampler_seed;
+      u32 samples_per_pixel;
+      u32 pending_passes;
+      u32 passes_done;
+    };
+    // Slot layout: State, then BUFFER_COUNT fixed point buffers of
+    // width * height * 4 values and the sample counts
+    static u64 align(u64 size) {
+      return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+    static u64 get_state_size() { return (sizeof(State) + 63) / 64 * 64; }
+    static u64 get_slot_size(u32 width, u32 height) {
+      u64 pixels = u64(width) * height;
+      return align(get_state_size() + BUFFER_COUNT * pixels * 4 * sizeof(i64) +
+                   pixels * sizeof(u32));
+    }
+    std::string path;
+    u32 width = 0, height = 0;
+    int fd = -1;
+    u8 *map = nullptr;
+    u64 map_size = 0;
+    ~Checkpoint_File() { unmap(); }
+    // Reads the header of an existing checkpoint without mapping it
+    static bool read_header(std::string const &path, Header &header) {
+      int file = ::open(path.c_str(), O_RDONLY);
+      if (file < 0)
+        return false;
+      bool ok = ::pread(file, &header, sizeof(header), 0) == sizeof(header);
+      ::close(file);
+      return ok && header.magic == MAGIC && header.version == VERSION;
+    }
+    // Maps the file, creating or resizing it if needed
+    // An existing file for other dimensions is reset to an empty checkpoint
+    bool map_file(std::string const &_path, u32 _width, u32 _height) {
+      if (map && path == _path && width == _width && height == _height)
+        return true;
+      unmap();
+      u64 size = ALIGNMENT + 2 * get_slot_size(_width, _height);
+      int file = ::open(_path.c_str(), O_RDWR | O_CREAT, 0644);
+      if (file < 0)
+        return false;
+      struct stat st;
+      bool resized = ::fstat(file, &st) != 0 || u64(st.st_size) != size;
+      if (resized && ::ftruncate(file, size) != 0) {
+        ::close(file);
+        return false;
+      }
+      void *ptr =
+          ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+      if (ptr == MAP_FAILED) {
+        ::close(file);
+        return false;
+      }
+      fd = file;
+      map = (u8 *)ptr;
+      map_size = size;
+      path = _path;
+      width = _width;
+      height = _height;
+      auto &header = get_header();
+      if (resized || header.magic != MAGIC || header.version != VERSION ||
+          header.width != width || header.height != height) {
+        header = Header{.magic = MAGIC,
+                        .version = VERSION,
+                        .width = width,
+                        .height = height,
+                        .current_slot = NO_SLOT};
+      }
+      return true;
+    }
+    void unmap() {
+      if (map)
+        ::munmap(map, map_size);
+      if (fd >= 0)
+        ::close(fd);
+      map = nullptr;
+      fd = -1;
+      map_size = 0;
+    }
+    Header &get_header() { return *(Header *)map; }
+    u8 *get_slot(u32 slot) {
+      return map + ALIGNMENT + u64(slot) * get_slot_size(width, height);
+    }
+    State &get_state(u32 slot) { return *(State *)get_slot(slot); }
+    i64 *get_buffer(u32 slot, u32 buffer_id) {
+      return (i64 *)(get_slot(slot) + get_state_size()) +
+             u64(buffer_id) * width * height * 4;
+    }
+    u32 *get_sample_count(u32 slot) {
+      return (u32 *)get_buffer(slot, BUFFER_COUNT);
+    }
+    u32 get_write_slot() {
+      return get_header().current_slot == 0 ? 1 : 0;
+    }
+    // Makes the written slot current
+    void commit(u32 slot) {
+      ::msync(get_slot(slot), get_slot_size(width, height), MS_SYNC);
+      get_header().current_slot = slot;
+      ::msync(map, ALIGNMENT, MS_SYNC);
+    }
+  } checkpoint_file;
+  // Checkpoints are written to checkpoint_path every checkpoint_interval
+  // full passes, empty path disables them
+  std::string checkpoint_path;
+  u32 checkpoint_interval = 16;
+  // passes_done of the last checkpoint
+  u32 checkpoint_passes = 0;
+  bool checkpoint_due() const {
+    return !checkpoint_path.empty() &&
+           primary_rays.passes_done >= checkpoint_passes + checkpoint_interval;
+  }
+  void write_checkpoint() {
+    auto &image = path_tracing_image;
+    if (!checkpoint_file.map_file(checkpoint_path, image.width,
+                                  image.height)) {
+      std::cerr << "[CHECKPOINT] Can't map " << checkpoint_path << "\n";
+      checkpoint_path.clear();
+      return;
+    }
+    u32 slot = checkpoint_file.get_write_slot();
+    auto &camera = path_tracing_camera;
+    checkpoint_file.get_state(slot) =
+        Checkpoint_File::State{.pos = camera.pos,
+                               .look = camera.look,
+                               .up = camera.up,
+                               .right = camera.right,
+                               .fov = camera.fov,
+                               .invtan = camera.invtan,
+                               .aspect = camera.aspect,
+                               .halton_counter = camera.halton_counter,
+                               .sampler_seed = sampler_seed,
+                               .samples_per_pixel = samples_per_pixel,
+                               .pending_passes = primary_rays.pending_passes,
+                               .passes_done = primary_rays.passes_done};
+    image.data_acc.copy_to(checkpoint_file.get_buffer(slot, 0));
+    image.odd_acc.copy_to(checkpoint_file.get_buffer(slot, 1));
+    image.normals_acc.copy_to(checkpoint_file.get_buffer(slot, 2));
+    image.albedo_acc.copy_to(checkpoint_file.get_buffer(slot, 3));
+    image.positions_acc.copy_to(checkpoint_file.get_buffer(slot, 4));
+    image.vertex_normals_acc.copy_to(checkpoint_file.get_buffer(slot, 5));
+    memcpy(checkpoint_file.get_sample_count(slot), &image.sample_count[0],
+           image.sample_count.size() * sizeof(u32));
+    checkpoint_file.commit(slot);
+    checkpoint_passes = primary_rays.passes_done;
+  }
+
   struct Path_Tracing_Job {
     vec3 ray_origin, ray_dir;
     // Color weight applied to the sampled light
@@ -464,53 +1345,552 @@ struct PT_Manager {
     f32 weight;
     // For visibility checks
     u32 light_id;
+    // Occlusion rays only look for hits closer than that
+    f32 t_max = FLT_MAX;
+    // Index of the camera sample this path belongs to
+    u32 sample_id = 0;
+    // Solid angle pdf of the BSDF sample that spawned the ray
+    // 0 when there is no env light sample to weight against
+    f32 bsdf_pdf = 0.0f;
+    // Ray cone for texture filtering: footprint width at the ray origin and
+    // spread angle
+    f32 cone_width = 0.0f;
+    f32 cone_spread = 0.0f;
     u32 depth,
         // Used to track down bugs
         _depth;
   };
 
+  // Structure of arrays batch of path tracing jobs
+  // The ISPC kernels read origins/directions straight out of it and shading
+  // writes new jobs into output streams
+  struct Ray_Stream {
+    static const u32 CAPACITY = 1 << 14;
+    f32 origin[3][CAPACITY];
+    f32 dir[3][CAPACITY];
+    f32 color[3][CAPACITY];
+    u32 pixel_x[CAPACITY];
+    u32 pixel_y[CAPACITY];
+    f32 weight[CAPACITY];
+    u32 light_id[CAPACITY];
+    f32 t_max[CAPACITY];
+    u32 sample_id[CAPACITY];
+    f32 bsdf_pdf[CAPACITY];
+    f32 cone_width[CAPACITY];
+    f32 cone_spread[CAPACITY];
+    u32 depth[CAPACITY];
+    u32 _depth[CAPACITY];
+    // Filled by the trace step
+    Collision collisions[CAPACITY];
+    u32 size = 0;
+    // Visibility rays that only need an any hit query
+    bool occlusion = false;
+    // Neighbouring rays go in similar directions, camera tiles and sorted
+    // streams are traced as packets
+    bool coherent = false;
+    bool full() const { return size == CAPACITY; }
+    Path_Tracing_Job get(u32 i) const {
+      Path_Tracing_Job job;
+      job.ray_origin = vec3(origin[0][i], origin[1][i], origin[2][i]);
+      job.ray_dir = vec3(dir[0][i], dir[1][i], dir[2][i]);
+      job.color = vec3(color[0][i], color[1][i], color[2][i]);
+      job.pixel_x = pixel_x[i];
+      job.pixel_y = pixel_y[i];
+      job.weight = weight[i];
+      job.light_id = light_id[i];
+      job.t_max = t_max[i];
+      job.sample_id = sample_id[i];
+      job.bsdf_pdf = bsdf_pdf[i];
+      job.cone_width = cone_width[i];
+      job.cone_spread = cone_spread[i];
+      job.depth = depth[i];
+      job._depth = _depth[i];
+      return job;
+    }
+    void set(u32 i, Path_Tracing_Job const &job) {
+      jto(3) {
+        origin[j][i] = job.ray_origin[j];
+        dir[j][i] = job.ray_dir[j];
+        color[j][i] = job.color[j];
+      }
+      pixel_x[i] = job.pixel_x;
+      pixel_y[i] = job.pixel_y;
+      weight[i] = job.weight;
+      light_id[i] = job.light_id;
+      t_max[i] = job.t_max;
+      sample_id[i] = job.sample_id;
+      bsdf_pdf[i] = job.bsdf_pdf;
+      cone_width[i] = job.cone_width;
+      cone_spread[i] = job.cone_spread;
+      depth[i] = job.depth;
+      _depth[i] = job._depth;
+    }
+    void push(Path_Tracing_Job const &job) {
+      ASSERT_PANIC(!full());
+      set(size++, job);
+    }
+    ISPC_Packed_Rays get_packed_rays() {
+      ISPC_Packed_Rays rays;
+      ito(3) {
+        rays.origin[i] = origin[i];
+        rays.dir[i] = dir[i];
+      }
+      rays.t_max = t_max;
+      return rays;
+    }
+  };
+
+  // Light rays spawned by the hits of a Surface_Batch. The scalar code picks
+  // the lights and samples the directions, ispc_eval_light_rays or
+  // Surface_Batch::eval_light_ray_scalar weight them by the BSDF
+  struct Light_Ray_Batch {
+    static const u32 CAPACITY = 1 << 12;
+    // Point and directional lights, same terms as the legacy shading
+    static const u32 LIGHT_RAY_DIRECT = 0;
+    // Plane lights sampled uniformly in their solid angle
+    static const u32 LIGHT_RAY_AREA = 1;
+    // Env map samples, MIS weighted against the BSDF pdf
+    static const u32 LIGHT_RAY_ENV = 2;
+    // Index of the hit in the surface batch
+    u32 surface[CAPACITY];
+    u32 kind[CAPACITY];
+    f32 dir[3][CAPACITY];
+    // Inverse pdf of the light selection, times the solid angle for plane
+    // lights
+    f32 scale[CAPACITY];
+    f32 env_pdf[CAPACITY];
+    // Path throughput of the light ray
+    f32 color[3][CAPACITY];
+    // Scalar side state
+    u32 light_id[CAPACITY];
+    f32 t_max[CAPACITY];
+    u32 size = 0;
+
+    static vec3 get(f32 const (&arr)[3][CAPACITY], u32 i) {
+      return vec3(arr[0][i], arr[1][i], arr[2][i]);
+    }
+    bool full() const { return size == CAPACITY; }
+    void push(u32 surface_id, u32 ray_kind, vec3 L, f32 ray_scale,
+              f32 ray_env_pdf, u32 ray_light_id, f32 ray_t_max) {
+      ASSERT_PANIC(size < CAPACITY);
+      u32 i = size++;
+      surface[i] = surface_id;
+      kind[i] = ray_kind;
+      jto(3) dir[j][i] = L[j];
+      scale[i] = ray_scale;
+      env_pdf[i] = ray_env_pdf;
+      light_id[i] = ray_light_id;
+      t_max[i] = ray_t_max;
+    }
+    ISPC_Packed_Light_Rays get_packed() {
+      ISPC_Packed_Light_Rays packed;
+      ito(3) {
+        packed.dir[i] = dir[i];
+        packed.color[i] = color[i];
+      }
+      packed.surface = surface;
+      packed.kind = kind;
+      packed.scale = scale;
+      packed.env_pdf = env_pdf;
+      return packed;
+    }
+  };
+
+  // Surface hits of a stream that survived alpha testing and russian
+  // roulette. The scalar gather does the material fetch and fills the
+  // inputs, ispc_shade_surfaces or shade_scalar fill the outputs and the
+  // scalar emit step pushes the jobs and spawns the light rays
+  struct Surface_Batch {
+    // Small enough to stay in cache between the gather and the emit step
+    static const u32 CAPACITY = 1 << 10;
+    static const u32 LOBE_SPECULAR_ABSORBED = 0;
+    static const u32 LOBE_SPECULAR = 1;
+    static const u32 LOBE_DIFFUSE = 2;
+    // Interpolated world space vertex frame
+    f32 normal[3][CAPACITY];
+    f32 tangent[3][CAPACITY];
+    f32 binormal[3][CAPACITY];
+    // Direction to the viewer
+    f32 view[3][CAPACITY];
+    f32 albedo[3][CAPACITY];
+    f32 normal_map[3][CAPACITY];
+    f32 roughness[CAPACITY];
+    f32 metalness[CAPACITY];
+    f32 xi[2][CAPACITY];
+    f32 lobe_u[CAPACITY];
+    f32 shading_normal[3][CAPACITY];
+    // Probability of the specular lobe
+    f32 ks[CAPACITY];
+    u32 lobe[CAPACITY];
+    f32 dir[3][CAPACITY];
+    // Multiplier of the path throughput
+    f32 throughput[3][CAPACITY];
+    // Solid angle pdf of dir within the chosen lobe
+    f32 pdf[CAPACITY];
+    f32 position[3][CAPACITY];
+    // Throughput of the path up to the hit
+    f32 path_color[3][CAPACITY];
+    f32 cone_spread[CAPACITY];
+    // Continuation ray: origin off the surface, path throughput and cone
+    // spread
+    f32 origin[3][CAPACITY];
+    f32 color[3][CAPACITY];
+    f32 spread[CAPACITY];
+    f32 nov[CAPACITY];
+    // Reflectance at 0 theta
+    f32 f0[3][CAPACITY];
+    // Scalar side state
+    Path_Tracing_Job jobs[CAPACITY];
+    Path_Sampler samplers[CAPACITY];
+    u32 size = 0;
+    Light_Ray_Batch light_rays;
+
+    static vec3 get(f32 const (&arr)[3][CAPACITY], u32 i) {
+      return vec3(arr[0][i], arr[1][i], arr[2][i]);
+    }
+    static void set(f32 (&arr)[3][CAPACITY], u32 i, vec3 v) {
+      jto(3) arr[j][i] = v[j];
+    }
+    void push(Path_Tracing_Job const &job, Path_Sampler sampler,
+              GLRF_Vertex_Static const &vertex, vec3 albedo_value,
+              vec3 normal_map_value, f32 roughness_value,
+              f32 metalness_value) {
+      ASSERT_PANIC(size < CAPACITY);
+      u32 i = size++;
+      set(normal, i, vertex.normal);
+      set(tangent, i, vertex.tangent);
+      set(binormal, i, vertex.binormal);
+      set(view, i, -job.ray_dir);
+      set(albedo, i, albedo_value);
+      set(normal_map, i, normal_map_value);
+      roughness[i] = roughness_value;
+      metalness[i] = metalness_value;
+      vec2 bounce_xi = sampler.get_2d();
+      xi[0][i] = bounce_xi.x;
+      xi[1][i] = bounce_xi.y;
+      lobe_u[i] = sampler.get_1d();
+      set(position, i, vertex.position);
+      set(path_color, i, job.color);
+      cone_spread[i] = job.cone_spread;
+      jobs[i] = job;
+      samplers[i] = sampler;
+    }
+    ISPC_Packed_Surfaces get_packed() {
+      ISPC_Packed_Surfaces packed;
+      ito(3) {
+        packed.normal[i] = normal[i];
+        packed.tangent[i] = tangent[i];
+        packed.binormal[i] = binormal[i];
+        packed.view[i] = view[i];
+        packed.albedo[i] = albedo[i];
+        packed.normal_map[i] = normal_map[i];
+        packed.shading_normal[i] = shading_normal[i];
+        packed.dir[i] = dir[i];
+        packed.throughput[i] = throughput[i];
+        packed.position[i] = position[i];
+        packed.path_color[i] = path_color[i];
+        packed.origin[i] = origin[i];
+        packed.color[i] = color[i];
+        packed.f0[i] = f0[i];
+      }
+      packed.roughness = roughness;
+      packed.metalness = metalness;
+      packed.xi[0] = xi[0];
+      packed.xi[1] = xi[1];
+      packed.lobe_u = lobe_u;
+      packed.ks = ks;
+      packed.lobe = lobe;
+      packed.pdf = pdf;
+      packed.cone_spread = cone_spread;
+      packed.spread = spread;
+      packed.nov = nov;
+      return packed;
+    }
+    // Reference for ispc_shade_surfaces
+    void shade_scalar(u32 i) {
+      vec3 nm = get(normal_map, i);
+      vec3 N = glm::normalize((2.0f * nm.x - 1.0f) * get(tangent, i) +
+                              (2.0f * nm.y - 1.0f) * get(binormal, i) +
+                              nm.z * get(normal, i));
+      vec3 V = get(view, i);
+      vec3 base_color = get(albedo, i);
+      f32 metal = metalness[i];
+      f32 rough = roughness[i];
+      float NoV = saturate(dot(N, V));
+      float Ks = clamp(metal + FresnelSchlickRoughness(
+                                   NoV, DIELECTRIC_SPECULAR, rough),
+                       0.0f, 1.0f);
+      vec2 bounce_xi = vec2(xi[0][i], xi[1][i]);
+      vec3 F0 = glm::mix(vec3(DIELECTRIC_SPECULAR), base_color, vec3(metal));
+      set(shading_normal, i, N);
+      ks[i] = Ks;
+      nov[i] = NoV;
+      set(f0, i, F0);
+      set(origin, i, get(position, i) + get(normal, i) * 1.0e-3f);
+      if (Ks > lobe_u[i]) {
+        vec3 brdf = vec3(0.0f);
+        vec3 L = sample_ggx(bounce_xi, N, V, F0, rough, brdf);
+        set(dir, i, L);
+        if (saturate(dot(N, L)) > 0.0f) {
+          lobe[i] = LOBE_SPECULAR;
+          set(throughput, i, (1.0f / Ks) * brdf);
+          pdf[i] = pdf_ggx(N, V, L, rough);
+        } else {
+          // The reflected ray is under the surface
+          lobe[i] = LOBE_SPECULAR_ABSORBED;
+          set(throughput, i, vec3(0.0f));
+          pdf[i] = 0.0f;
+        }
+      } else {
+        vec3 up = std::abs(N.y) < 0.999f ? vec3(0.0f, 1.0f, 0.0f)
+                                         : vec3(0.0f, 0.0f, 1.0f);
+        vec3 T = glm::normalize(glm::cross(up, N));
+        vec3 B = glm::cross(T, N);
+        T = glm::cross(B, N);
+        // Cosine biased sampling
+        vec3 rand = SampleHemisphere_Cosinus(bounce_xi);
+        set(dir, i, glm::normalize(T * rand.x + B * rand.y + N * rand.z));
+        lobe[i] = LOBE_DIFFUSE;
+        set(throughput, i,
+            (1.0f / (1.0f - Ks)) * base_color * (1.0f - DIELECTRIC_SPECULAR) *
+                (1.0f - metal));
+        pdf[i] = rand.z * INV_PI;
+      }
+      set(color, i, get(throughput, i) * get(path_color, i));
+      // Rough lobes widen the cone, diffuse bounces only need a blurry
+      // lookup
+      spread[i] = cone_spread[i] +
+                  (lobe[i] == LOBE_DIFFUSE ? 1.0f : rough * rough);
+    }
+    // Reference for ispc_eval_light_rays
+    void eval_light_ray_scalar(u32 k) {
+      u32 i = light_rays.surface[k];
+      vec3 N = get(shading_normal, i);
+      vec3 V = get(view, i);
+      vec3 L = Light_Ray_Batch::get(light_rays.dir, k);
+      vec3 F0 = get(f0, i);
+      f32 rough = roughness[i];
+      float NoV = nov[i];
+      float NoL = saturate(dot(N, L));
+      float Ks = ks[i];
+      float Kd = 1.0f - Ks;
+      u32 kind = light_rays.kind[k];
+      vec3 diffuse =
+          get(albedo, i) * (1.0f - DIELECTRIC_SPECULAR) * (1.0f - metalness[i]);
+      vec3 weight;
+      if (lobe[i] != LOBE_DIFFUSE) {
+        // eval_ggx is D * F * G
+        vec3 brdf = eval_ggx(N, V, L, rough, F0);
+        if (kind == Light_Ray_Batch::LIGHT_RAY_DIRECT) {
+          weight = brdf * (light_rays.scale[k] / Ks);
+        } else if (kind == Light_Ray_Batch::LIGHT_RAY_AREA) {
+          weight = brdf * (light_rays.scale[k] / (4.0f * NoV * Ks));
+        } else {
+          float env_pdf = light_rays.env_pdf[k];
+          float w = mis_weight(env_pdf, pdf_ggx(N, V, L, rough));
+          weight = brdf * (w / (Ks * env_pdf * 4.0f * NoV));
+        }
+      } else {
+        if (kind == Light_Ray_Batch::LIGHT_RAY_DIRECT) {
+          weight = diffuse * (light_rays.scale[k] * NoL / Kd);
+        } else if (kind == Light_Ray_Batch::LIGHT_RAY_AREA) {
+          weight = diffuse * (light_rays.scale[k] * NoL * INV_PI / Kd);
+        } else {
+          float env_pdf = light_rays.env_pdf[k];
+          float w = mis_weight(env_pdf, NoL * INV_PI);
+          weight = diffuse * (w * NoL * INV_PI / (Kd * env_pdf));
+        }
+      }
+      jto(3) light_rays.color[j][k] = weight[j] * path_color[j][i];
+    }
+  };
+  // Scratch batches of shade_stream, one per stream in flight
+  std::vector<std::unique_ptr<Surface_Batch>> free_surface_batches;
+  std::mutex surface_batch_mutex;
+  std::unique_ptr<Surface_Batch> alloc_surface_batch() {
+    std::unique_ptr<Surface_Batch> batch;
+    {
+      std::scoped_lock<std::mutex> sl(surface_batch_mutex);
+      if (!free_surface_batches.empty()) {
+        batch = std::move(free_surface_batches.back());
+        free_surface_batches.pop_back();
+      }
+    }
+    if (!batch)
+      batch.reset(new Surface_Batch);
+    batch->size = 0;
+    batch->light_rays.size = 0;
+    return batch;
+  }
+  void release_surface_batch(std::unique_ptr<Surface_Batch> batch) {
+    std::scoped_lock<std::mutex> sl(surface_batch_mutex);
+    free_surface_batches.emplace_back(std::move(batch));
+  }
+
   // Poor man's queue
-  // Not thread safe in all scenarios but kind of works in mine
-  // @Cleanup
+  // Multi-producer/multi-consumer queue of ray streams
+  // Memory is proportional to the number of jobs in flight: streams are
+  // allocated on demand and recycled through a bounded free list
+  // Streams are popped in LIFO order so secondary rays drain before new
+  // primary rays are generated
   struct Path_Tracing_Queue {
-    std::vector<Path_Tracing_Job> job_queue;
-    std::atomic<u32> head = 0;
+    static const u32 MAX_FREE_STREAMS = 64;
+    std::vector<std::unique_ptr<Ray_Stream>> streams;
+    std::vector<std::unique_ptr<Ray_Stream>> free_streams;
+    std::atomic<u64> total_size = 0;
+    // Max size since the last reset_peak
+    u64 peak_size = 0;
     std::mutex mutex;
-    Path_Tracing_Queue() { job_queue.resize(512 * 512 * 256); }
-    Path_Tracing_Job dequeue() {
-      ASSERT_PANIC(head);
-      u32 old_head = head.fetch_sub(1);
-      auto back = job_queue[old_head - 1];
-
-      return back;
+    std::unique_ptr<Ray_Stream> alloc_stream() {
+      std::unique_ptr<Ray_Stream> stream;
+      {
+        std::scoped_lock<std::mutex> sl(mutex);
+        if (!free_streams.empty()) {
+          stream = std::move(free_streams.back());
+          free_streams.pop_back();
+        }
+      }
+      if (!stream)
+        stream.reset(new Ray_Stream);
+      stream->size = 0;
+      stream->occlusion = false;
+      stream->coherent = false;
+      return stream;
+    }
+    void release_stream(std::unique_ptr<Ray_Stream> stream) {
+      std::scoped_lock<std::mutex> sl(mutex);
+      if (free_streams.size() < MAX_FREE_STREAMS)
+        free_streams.emplace_back(std::move(stream));
     }
-    // called in a single thread
-    void dequeue(std::vector<Path_Tracing_Job> &out, u32 &count) {
-      if (head < count) {
-        count = head;
+    void enqueue(std::unique_ptr<Ray_Stream> stream) {
+      if (stream->size == 0) {
+        release_stream(std::move(stream));
+        return;
       }
-      u32 old_head = head.fetch_sub(count);
-      memcpy(&out[0], &job_queue[head], count * sizeof(out[0]));
+      std::scoped_lock<std::mutex> sl(mutex);
+      total_size += stream->size;
+      peak_size = std::max(peak_size, u64(total_size));
+      streams.emplace_back(std::move(stream));
     }
+    // Appends to the last queued stream while it has room, a new stream is
+    // only allocated when it is full or of another kind
     void enqueue(Path_Tracing_Job job) {
-      //      std::scoped_lock<std::mutex> sl(mutex);
       ASSERT_PANIC(!std::isnan(job.ray_dir.x) && !std::isnan(job.ray_dir.y) &&
                    !std::isnan(job.ray_dir.z));
-      u32 old_head = head.fetch_add(1);
-      job_queue[old_head] = job;
-      ASSERT_PANIC(head < job_queue.size());
-    }
-    void enqueue(std::vector<Path_Tracing_Job> const &jobs) {
-      u32 old_head = head.fetch_add(u32(jobs.size()));
-      ASSERT_PANIC(head < job_queue.size());
-      //      for (auto &job : jobs) {
-      //        ASSERT_PANIC(length(job.ray_dir) > 0.0f);
-      //      }
-      memcpy(&job_queue[old_head], &jobs[0], jobs.size() * sizeof(jobs[0]));
-    }
-    bool has_job() { return head != 0u; }
-    void reset() { head = 0u; }
+      {
+        std::scoped_lock<std::mutex> sl(mutex);
+        if (!streams.empty()) {
+          auto &back = *streams.back();
+          if (!back.full() && !back.occlusion && !back.coherent) {
+            back.push(job);
+            total_size++;
+            peak_size = std::max(peak_size, u64(total_size));
+            return;
+          }
+        }
+      }
+      std::unique_ptr<Ray_Stream> stream = alloc_stream();
+      stream->push(job);
+      enqueue(std::move(stream));
+    }
+    Path_Tracing_Job dequeue() {
+      std::scoped_lock<std::mutex> sl(mutex);
+      ASSERT_PANIC(!streams.empty());
+      auto &stream = streams.back();
+      auto back = stream->get(--stream->size);
+      if (stream->size == 0) {
+        if (free_streams.size() < MAX_FREE_STREAMS)
+          free_streams.emplace_back(std::move(stream));
+        streams.pop_back();
+      }
+      total_size--;
+      return back;
+    }
+    // Pops whole streams until max_jobs is reached
+    // Jobs that spawn new jobs when shaded, all but visibility rays, are
+    // limited to max_spawning in total, the last stream is split to fit
+    // Returns the number of jobs popped
+    u32 dequeue(std::vector<std::unique_ptr<Ray_Stream>> &out, u32 max_jobs,
+                u32 max_spawning = ~0u) {
+      std::scoped_lock<std::mutex> sl(mutex);
+      u32 count = 0;
+      u32 spawning = 0;
+      while (!streams.empty() &&
+             (count == 0 || count + streams.back()->size <= max_jobs)) {
+        auto &back = streams.back();
+        if (!back->occlusion && spawning + back->size > max_spawning) {
+          u32 room = max_spawning - spawning;
+          if (room == 0)
+            break;
+          // Move the tail of the stream to a stream of its own
+          std::unique_ptr<Ray_Stream> part;
+          if (!free_streams.empty()) {
+            part = std::move(free_streams.back());
+            free_streams.pop_back();
+          } else {
+            part.reset(new Ray_Stream);
+          }
+          part->size = 0;
+          part->occlusion = false;
+          part->coherent = back->coherent;
+          ito(room) part->push(back->get(back->size - room + i));
+          back->size -= room;
+          count += room;
+          out.emplace_back(std::move(part));
+          break;
+        }
+        if (!back->occlusion)
+          spawning += back->size;
+        count += back->size;
+        out.emplace_back(std::move(back));
+        streams.pop_back();
+      }
+      total_size -= count;
+      return count;
+    }
+    u64 size() { return total_size; }
+    bool has_job() { return total_size != 0u; }
+    void reset_peak() {
+      std::scoped_lock<std::mutex> sl(mutex);
+      peak_size = total_size;
+    }
+    void reset() {
+      std::scoped_lock<std::mutex> sl(mutex);
+      while (!streams.empty()) {
+        if (free_streams.size() < MAX_FREE_STREAMS)
+          free_streams.emplace_back(std::move(streams.back()));
+        streams.pop_back();
+      }
+      total_size = 0;
+      peak_size = 0;
+    }
   } path_tracing_queue;
+  // Fills streams taken from the queue's free list and enqueues them once
+  // they are full
+  struct Ray_Stream_Writer {
+    Path_Tracing_Queue &queue;
+    std::unique_ptr<Ray_Stream> stream;
+    bool occlusion = false;
+    bool coherent = false;
+    Ray_Stream_Writer(Path_Tracing_Queue &queue, bool occlusion = false,
+                      bool coherent = false)
+        : queue(queue), occlusion(occlusion), coherent(coherent) {}
+    ~Ray_Stream_Writer() { flush(); }
+    void push(Path_Tracing_Job const &job) {
+      if (!stream) {
+        stream = queue.alloc_stream();
+        stream->occlusion = occlusion;
+        stream->coherent = coherent;
+      }
+      stream->push(job);
+      if (stream->full())
+        flush();
+    }
+    void flush() {
+      if (stream)
+        queue.enqueue(std::move(stream));
+    }
+  };
   void eval_debug_ray(Scene &scene) {
     u32 width = path_tracing_image.width;
     u32 height = path_tracing_image.height;
@@ -534,12 +1914,12 @@ struct PT_Manager {
     job.color = vec3(1.0f, 1.0f, 1.0f);
     job.depth = 0;
     job._depth = 0;
-    path_tracing_queue.reset();
+    reset_queue();
     path_tracing_queue.enqueue(job);
     path_tracing_camera._grab_path = true;
     path_tracing_camera._debug_path.clear();
     //    path_tracing_camera._debug_path.push_back(job.ray_origin);
-    while (path_tracing_queue.has_job())
+    while (has_work())
       path_tracing_iteration(scene);
     path_tracing_camera._grab_path = false;
   }
@@ -556,30 +1936,133 @@ struct PT_Manager {
     //        float(example_viewport.extent.width) /
     //        example_viewport.extent.height;
   };
-  void add_primary_rays() {
+  // Primary rays are generated lazily tile by tile at the start of each
+  // step while the queue is below the step's queue_limit
+  static const u32 PRIMARY_TILE_SIZE = 16;
+  struct Primary_Rays_State {
+    // Number of scheduled full frame passes
+    u32 pending_passes = 0;
+    // Next tile of the current pass
+    u32 tile_cursor = 0;
+    u32 passes_done = 0;
+    // Pixels sampled by the current pass, empty means all of them
+    std::vector<u8> active_pixels;
+  } primary_rays;
+  // Picks the pixels for the next pass from the two buffer error estimate
+  void select_adaptive_pixels() {
+    auto &mask = primary_rays.active_pixels;
+    mask.clear();
+    if (!adaptive_sampling || primary_rays.passes_done < adaptive_min_passes)
+      return;
+    u32 pixel_count = path_tracing_image.width * path_tracing_image.height;
+    std::vector<f32> errors(pixel_count);
+    u32 above = 0;
+    ito(pixel_count) {
+      errors[i] = path_tracing_image.get_error(i);
+      if (errors[i] > adaptive_threshold)
+        above++;
+    }
+    f32 threshold = adaptive_threshold;
+    u32 max_pixels =
+        std::max(1u, adaptive_ray_budget / std::max(1u, samples_per_pixel));
+    if (above > max_pixels) {
+      // Raise the threshold so that only the noisiest max_pixels remain
+      std::vector<f32> sorted = errors;
+      std::nth_element(sorted.begin(),
+                       sorted.begin() + (pixel_count - max_pixels),
+                       sorted.end());
+      threshold = sorted[pixel_count - max_pixels];
+    }
+    mask.resize(pixel_count);
+    stats.adaptive_pixels = 0;
+    ito(pixel_count) {
+      mask[i] = errors[i] > threshold ? 1 : 0;
+      stats.adaptive_pixels += mask[i];
+    }
+    // Pixels tied at a raised threshold fill the rest of the budget. They
+    // can be all of them, e.g. FLT_MAX for pixels without odd samples yet
+    if (above > max_pixels) {
+      for (u32 i = 0; i < pixel_count && stats.adaptive_pixels < max_pixels;
+           i++) {
+        if (!mask[i] && errors[i] >= threshold) {
+          mask[i] = 1;
+          stats.adaptive_pixels++;
+        }
+      }
+    }
+  }
+  void add_primary_rays() { primary_rays.pending_passes++; }
+  bool has_work() {
+    return path_tracing_queue.has_job() || primary_rays.pending_passes != 0u;
+  }
+  void reset_queue() {
+    path_tracing_queue.reset();
+    primary_rays = {};
+  }
+  void generate_primary_rays(u64 queue_limit) {
     u32 width = path_tracing_image.width;
     u32 height = path_tracing_image.height;
+    if (!width || !height || !primary_rays.pending_passes)
+      return;
+    // Let the queue drain so that the checkpoint holds whole passes
+    if (primary_rays.tile_cursor == 0 && checkpoint_due())
+      return;
     ASSERT_PANIC(samples_per_pixel <= 128);
-    vec2 halton_cache[128];
-    ito(samples_per_pixel) {
-      f32 jitter_u = halton(i + path_tracing_camera.halton_counter + 1, 2);
-      f32 jitter_v = halton(i + path_tracing_camera.halton_counter + 1, 3);
-      halton_cache[i] = vec2(jitter_u, jitter_v);
+    u32 tiles_x = (width + PRIMARY_TILE_SIZE - 1) / PRIMARY_TILE_SIZE;
+    u32 tiles_y = (height + PRIMARY_TILE_SIZE - 1) / PRIMARY_TILE_SIZE;
+    u32 tile_count = tiles_x * tiles_y;
+    u64 jobs_per_tile =
+        u64(PRIMARY_TILE_SIZE * PRIMARY_TILE_SIZE) * samples_per_pixel;
+    u64 queue_size = path_tracing_queue.size();
+    // Back off until the consumers drain the queue
+    if (queue_size >= queue_limit)
+      return;
+    u32 tiles = u32(std::min<u64>(tile_count - primary_rays.tile_cursor,
+                                  (queue_limit - queue_size) / jobs_per_tile));
+    // A tile can be bigger than queue_limit, let one through on an empty
+    // queue so that the render keeps going
+    if (tiles == 0 && queue_size == 0)
+      tiles = 1;
+    if (tiles == 0)
+      return;
+    if (primary_rays.tile_cursor == 0) {
+      select_adaptive_pixels();
+      if (!primary_rays.active_pixels.empty() && !stats.adaptive_pixels) {
+        // Every pixel is below the threshold. Without new samples the
+        // estimate stays the same, so the other passes would select
+        // nothing either
+        primary_rays.active_pixels.clear();
+        primary_rays.pending_passes = 0;
+        return;
+      }
     }
+    // Angle subtended by a pixel
+    f32 pixel_spread = 2.0f / (path_tracing_camera.invtan * f32(height));
     WorkPayload work_payload;
-    const u32 rows_per_item = 64;
-    u32 items = (height + rows_per_item - 1) / rows_per_item;
-    work_payload.reserve(items);
-    ito(items) {
+    work_payload.reserve(tiles);
+    ito(tiles) {
       work_payload.push_back(JobPayload{
           .func =
-              [this, width, height, halton_cache](JobDesc desc) {
-                for (u32 i = desc.offset; i < desc.offset + desc.size; i++) {
-                  std::vector<Path_Tracing_Job> jobs(width * samples_per_pixel);
-                  u32 counter = 0;
-                  jto(width) {
+              [this, width, height, tiles_x, pixel_spread](JobDesc desc) {
+                u32 tile_x = (desc.offset % tiles_x) * PRIMARY_TILE_SIZE;
+                u32 tile_y = (desc.offset / tiles_x) * PRIMARY_TILE_SIZE;
+                // Camera rays of a tile share origin and similar directions
+                Ray_Stream_Writer writer(path_tracing_queue, false, true);
+                for (u32 i = tile_y;
+                     i < std::min(height, tile_y + PRIMARY_TILE_SIZE); i++) {
+                  for (u32 j = tile_x;
+                       j < std::min(width, tile_x + PRIMARY_TILE_SIZE); j++) {
+                    u32 pixel_id = j + i * width;
+                    if (!primary_rays.active_pixels.empty() &&
+                        !primary_rays.active_pixels[pixel_id])
+                      continue;
+                    // Tiles don't overlap so there is no race here
+                    path_tracing_image.sample_count[pixel_id] +=
+                        samples_per_pixel;
                     kto(samples_per_pixel) {
-                      vec2 jitter = halton_cache[k];
+                      u32 sample_id = path_tracing_camera.halton_counter + k;
+                      vec2 jitter =
+                          get_sampler(j, i, sample_id, 0).get_2d();
                       f32 u = (f32(j) + jitter.x) / width * 2.0f - 1.0f;
                       f32 v = -(f32(i) + jitter.y) / height * 2.0f + 1.0f;
                       Path_Tracing_Job job;
@@ -592,16 +2075,14 @@ struct PT_Manager {
                       job.color = vec3(1.0f, 1.0f, 1.0f);
                       job.depth = 0;
                       job._depth = 0;
-                      jobs[counter++] = job;
+                      job.sample_id = sample_id;
+                      job.cone_spread = pixel_spread;
+                      writer.push(job);
                     }
                   }
-                  ASSERT_PANIC(counter == jobs.size());
-                  path_tracing_queue.enqueue(jobs);
                 }
               },
-          .desc = JobDesc{.offset = i * rows_per_item,
-                          .size = std::min(u32(height) - i * rows_per_item,
-                                           rows_per_item)}});
+          .desc = JobDesc{.offset = primary_rays.tile_cursor + i, .size = 1}});
     }
     marl::WaitGroup wg(work_payload.size());
     for (u32 i = 0; i < work_payload.size(); i++) {
@@ -613,25 +2094,405 @@ struct PT_Manager {
       });
     }
     wg.wait();
-    path_tracing_camera.halton_counter += samples_per_pixel;
+    primary_rays.tile_cursor += tiles;
+    if (primary_rays.tile_cursor == tile_count) {
+      primary_rays.tile_cursor = 0;
+      primary_rays.pending_passes--;
+      primary_rays.passes_done++;
+      path_tracing_camera.halton_counter += samples_per_pixel;
+    }
   };
   void reset_path_tracing_state(Camera const &camera, u32 width, u32 height) {
     grab_path_tracing_cam(camera, float(width) / height);
-    path_tracing_queue.reset();
+    reset_queue();
     path_tracing_image.init(width, height);
     path_tracing_camera.aspect = f32(width) / height;
     add_primary_rays();
+    checkpoint_passes = 0;
   };
+  // Max distance between the old and the new first hit relative to the
+  // distance to the camera
+  f32 reprojection_depth_tolerance = 0.02f;
+  // Min cosine between the old and the new first hit normal
+  f32 reprojection_normal_tolerance = 0.8f;
+  // Moves the camera keeping the samples of the pixels that still see the
+  // same surface
+  // A ray through each new pixel center finds the first hit, which is
+  // projected into the old view. The old pixel is kept if its average first
+  // hit position and normal match, escaped rays match escaped pixels. The
+  // other pixels restart from zero
+  void reproject_path_tracing_state(Scene &scene, Camera const &camera) {
+    auto &image = path_tracing_image;
+    u32 width = image.width;
+    u32 height = image.height;
+    if (!width || !height)
+      return;
+    auto old_camera = path_tracing_camera;
+    Fixed_Point_Buffer *buffers[] = {&image.data_acc, &image.odd_acc,
+                                     &image.normals_acc, &image.albedo_acc,
+                                     &image.positions_acc,
+                                     &image.vertex_normals_acc};
+    const u32 BUFFER_COUNT = 6;
+    std::vector<i64> old_values[BUFFER_COUNT];
+    std::vector<i64> new_values[BUFFER_COUNT];
+    ito(BUFFER_COUNT) {
+      old_values[i].resize(width * height * 4);
+      new_values[i].resize(width * height * 4, 0);
+      buffers[i]->copy_to(&old_values[i][0]);
+    }
+    std::vector<u32> old_sample_count = image.sample_count;
+    grab_path_tracing_cam(camera, f32(width) / height);
+    // Keep the sample sequences going, restarting them would repeat the
+    // samples of the pixels that didn't move
+    path_tracing_camera.halton_counter = old_camera.halton_counter;
+    reset_queue();
+    image.init(width, height);
+    auto get_old = [&](u32 buffer_id, u32 pixel_id) {
+      vec4 out;
+      ito(4) out[i] = f32(old_values[buffer_id][pixel_id * 4 + i]) /
+                      Fixed_Point_Buffer::SCALE;
+      return out;
+    };
+    std::atomic<u32> reprojected_pixels = 0;
+    marl::WaitGroup wg(height);
+    for (u32 y = 0; y < height; y++) {
+      marl::schedule([&, y] {
+        defer(wg.done());
+        u32 row_reprojected = 0;
+        for (u32 x = 0; x < width; x++) {
+          f32 u = (f32(x) + 0.5f) / width * 2.0f - 1.0f;
+          f32 v = -(f32(y) + 0.5f) / height * 2.0f + 1.0f;
+          vec3 ray_dir = path_tracing_camera.gen_ray(u, v);
+          vec3 ray_origin = path_tracing_camera.pos;
+          Collision col{.t = 1.0e10f};
+          bool hit = scene.intersect(ray_origin, ray_dir, col);
+          vec3 position = ray_origin + ray_dir * col.t;
+          vec2 old_uv;
+          // Escaped rays only depend on the direction
+          if (!old_camera.project(hit ? glm::normalize(position -
+                                                       old_camera.pos)
+                                      : ray_dir,
+                                  old_uv))
+            continue;
+          i32 old_x = i32(std::floor((old_uv.x * 0.5f + 0.5f) * width));
+          i32 old_y = i32(std::floor((-old_uv.y * 0.5f + 0.5f) * height));
+          if (old_x < 0 || old_y < 0 || old_x >= i32(width) ||
+              old_y >= i32(height))
+            continue;
+          u32 old_id = u32(old_x) + u32(old_y) * width;
+          u32 samples = old_sample_count[old_id];
+          if (!samples)
+            continue;
+          vec4 old_position = get_old(4, old_id);
+          // sample_count also has the samples that were still in flight, so
+          // the ratio is only a majority vote
+          f32 hit_ratio = old_position.w / f32(samples);
+          if (hit) {
+            if (hit_ratio < 0.5f)
+              continue;
+            vec3 old_pos = vec3(old_position) / old_position.w;
+            f32 dist = glm::length(position - old_camera.pos);
+            if (glm::length(old_pos - position) >
+                reprojection_depth_tolerance * dist)
+              continue;
+            vec4 old_normal = get_old(5, old_id);
+            auto &node = scene.scene_nodes[col.mesh_id - 1];
+            vec3 normal = scene
+                              .get_interpolated_vertex(node, col.face_id,
+                                                       vec2(col.u, col.v))
+                              .normal;
+            if (glm::length(vec3(old_normal)) < 1.0e-6f ||
+                glm::dot(glm::normalize(vec3(old_normal)), normal) <
+                    reprojection_normal_tolerance)
+              continue;
+          } else if (hit_ratio >= 0.5f) {
+            continue;
+          }
+          u32 pixel_id = x + y * width;
+          ito(BUFFER_COUNT) jto(4) new_values[i][pixel_id * 4 + j] =
+              old_values[i][old_id * 4 + j];
+          image.sample_count[pixel_id] = samples;
+          row_reprojected++;
+        }
+        reprojected_pixels += row_reprojected;
+      });
+    }
+    wg.wait();
+    ito(BUFFER_COUNT) buffers[i]->copy_from(&new_values[i][0]);
+    stats.reprojected_pixels = reprojected_pixels;
+    image.resolve_pending = true;
+    image.resolve();
+    add_primary_rays();
+    checkpoint_passes = 0;
+  }
+  // Restores the render saved in the checkpoint at path and keeps writing
+  // checkpoints there
+  // Returns false if there is no valid checkpoint
+  bool resume_path_tracing_state(std::string const &path) {
+    Checkpoint_File::Header header;
+    if (!Checkpoint_File::read_header(path, header) ||
+        header.current_slot > 1 || !header.width || !header.height)
+      return false;
+    if (!checkpoint_file.map_file(path, header.width, header.height))
+      return false;
+    u32 slot = checkpoint_file.get_header().current_slot;
+    if (slot > 1)
+      return false;
+    auto const &state = checkpoint_file.get_state(slot);
+    reset_queue();
+    auto &image = path_tracing_image;
+    image.init(header.width, header.height);
+    auto &camera = path_tracing_camera;
+    camera.pos = state.pos;
+    camera.look = state.look;
+    camera.up = state.up;
+    camera.right = state.right;
+    camera.fov = state.fov;
+    camera.invtan = state.invtan;
+    camera.aspect = state.aspect;
+    camera.halton_counter = state.halton_counter;
+    // The sample sequences must continue where they stopped
+    sampler_seed = state.sampler_seed;
+    samples_per_pixel = state.samples_per_pixel;
+    primary_rays.pending_passes = state.pending_passes;
+    primary_rays.passes_done = state.passes_done;
+    image.data_acc.copy_from(checkpoint_file.get_buffer(slot, 0));
+    image.odd_acc.copy_from(checkpoint_file.get_buffer(slot, 1));
+    image.normals_acc.copy_from(checkpoint_file.get_buffer(slot, 2));
+    image.albedo_acc.copy_from(checkpoint_file.get_buffer(slot, 3));
+    image.positions_acc.copy_from(checkpoint_file.get_buffer(slot, 4));
+    image.vertex_normals_acc.copy_from(checkpoint_file.get_buffer(slot, 5));
+    memcpy(&image.sample_count[0], checkpoint_file.get_sample_count(slot),
+           image.sample_count.size() * sizeof(u32));
+    image.resolve_pending = true;
+    image.resolve();
+    checkpoint_path = path;
+    checkpoint_passes = state.passes_done;
+    return true;
+  }
 
-  std::vector<Path_Tracing_Job> ray_jobs;
+  std::vector<std::unique_ptr<Ray_Stream>> ray_streams;
+  // (sort key << 32 | ray id) pairs for sort_ray_streams
+  std::vector<u64> ray_keys;
+  std::vector<u64> ray_keys_tmp;
+  // Key: 1 bit of stream kind, 3 bits of direction octant and the upper 28
+  // bits of the Morton code of the origin inside the scene bounds
+  static u32 get_ray_sort_key(Ray_Stream const &stream, u32 i, vec3 scene_min,
+                              vec3 scene_extent) {
+    u32 octant = (stream.dir[0][i] < 0.0f ? 4u : 0u) |
+                 (stream.dir[1][i] < 0.0f ? 2u : 0u) |
+                 (stream.dir[2][i] < 0.0f ? 1u : 0u);
+    vec3 origin =
+        vec3(stream.origin[0][i], stream.origin[1][i], stream.origin[2][i]);
+    return (stream.occlusion ? 1u << 31 : 0u) | (octant << 28) |
+           (morton_3d((origin - scene_min) / scene_extent) >> 2);
+  }
+  // Same order as sort_ray_streams within a single stream, for the streams
+  // the pipeline takes from the queue during a step
+  std::unique_ptr<Ray_Stream> sort_ray_stream(Scene &scene,
+                                              std::unique_ptr<Ray_Stream> src) {
+    if (scene.tlas.nodes.empty())
+      return src;
+    vec3 scene_min = scene.tlas.nodes[0].min;
+    vec3 scene_extent =
+        glm::max(scene.tlas.nodes[0].max - scene_min, vec3(1.0e-6f));
+    std::vector<u64> keys(src->size);
+    ito(src->size) keys[i] =
+        (u64(get_ray_sort_key(*src, i, scene_min, scene_extent)) << 32) |
+        u64(i);
+    std::sort(keys.begin(), keys.end());
+    auto dst = path_tracing_queue.alloc_stream();
+    dst->occlusion = src->occlusion;
+    dst->coherent = true;
+    for (u64 key : keys)
+      dst->push(src->get(u32(key)));
+    path_tracing_queue.release_stream(std::move(src));
+    return dst;
+  }
+  // Regroups the rays of ray_streams into new streams so that neighbouring
+  // lanes start in the same region going in the same direction
+  void sort_ray_streams(Scene &scene) {
+    if (ray_streams.empty() || scene.tlas.nodes.empty())
+      return;
+    const u32 CAPACITY = Ray_Stream::CAPACITY;
+    vec3 scene_min = scene.tlas.nodes[0].min;
+    vec3 scene_extent =
+        glm::max(scene.tlas.nodes[0].max - scene_min, vec3(1.0e-6f));
+    u32 jobs_count = 0;
+    for (auto &stream : ray_streams)
+      jobs_count += stream->size;
+    ray_keys.resize(jobs_count);
+    ray_keys_tmp.resize(jobs_count);
+    auto parallel_for = [](u32 count, std::function<void(u32)> func) {
+      marl::WaitGroup wg(count);
+      ito(count) {
+        marl::schedule([=] {
+          defer(wg.done());
+          func(i);
+        });
+      }
+      wg.wait();
+    };
+    // Ray ids are stream_id * CAPACITY + lane
+    std::vector<u32> key_offsets(ray_streams.size());
+    {
+      u32 offset = 0;
+      ito(ray_streams.size()) {
+        key_offsets[i] = offset;
+        offset += ray_streams[i]->size;
+      }
+    }
+    parallel_for(ray_streams.size(), [&](u32 stream_id) {
+      auto &stream = *ray_streams[stream_id];
+      ito(stream.size) {
+        u32 key = get_ray_sort_key(stream, i, scene_min, scene_extent);
+        ray_keys[key_offsets[stream_id] + i] =
+            (u64(key) << 32) | u64(stream_id * CAPACITY + i);
+      }
+    });
+    // LSD radix sort on the upper 32 bits
+    for (u32 shift = 32; shift < 64; shift += 8) {
+      u32 histogram[256] = {};
+      for (u64 key : ray_keys)
+        histogram[(key >> shift) & 0xffu]++;
+      u32 sum = 0;
+      ito(256) {
+        u32 count = histogram[i];
+        histogram[i] = sum;
+        sum += count;
+      }
+      for (u64 key : ray_keys)
+        ray_keys_tmp[histogram[(key >> shift) & 0xffu]++] = key;
+      std::swap(ray_keys, ray_keys_tmp);
+    }
+    // Scatter into new streams
+    // Occlusion rays are sorted last and must not share a stream with others
+    u32 occlusion_begin = 0;
+    for (auto &stream : ray_streams)
+      if (!stream->occlusion)
+        occlusion_begin += stream->size;
+    struct Stream_Range {
+      u32 begin, end;
+    };
+    std::vector<Stream_Range> ranges;
+    for (u32 i = 0; i < occlusion_begin; i += CAPACITY)
+      ranges.push_back({i, std::min(occlusion_begin, i + CAPACITY)});
+    for (u32 i = occlusion_begin; i < jobs_count; i += CAPACITY)
+      ranges.push_back({i, std::min(jobs_count, i + CAPACITY)});
+    std::vector<std::unique_ptr<Ray_Stream>> sorted_streams(ranges.size());
+    ito(ranges.size()) {
+      sorted_streams[i] = path_tracing_queue.alloc_stream();
+      sorted_streams[i]->occlusion = ranges[i].begin >= occlusion_begin;
+      sorted_streams[i]->coherent = true;
+    }
+    parallel_for(sorted_streams.size(), [&](u32 dst_id) {
+      auto &dst = *sorted_streams[dst_id];
+      u32 begin = ranges[dst_id].begin;
+      u32 end = ranges[dst_id].end;
+      for (u32 i = begin; i < end; i++) {
+        u32 ray_id = u32(ray_keys[i]);
+        dst.push(ray_streams[ray_id / CAPACITY]->get(ray_id % CAPACITY));
+      }
+    });
+    for (auto &stream : ray_streams)
+      path_tracing_queue.release_stream(std::move(stream));
+    ray_streams = std::move(sorted_streams);
+  }
   std::vector<u32> point_lights;
   std::vector<u32> plane_lights;
   std::vector<u32> dir_lights;
-  std::vector<vec3> ray_dirs;
-  std::vector<vec3> ray_origins;
-  std::vector<Collision> ray_collisions;
+  // Power weighted light selection, indexed by light_id - 1
+  Alias_Table light_table;
+  struct Light_Sample {
+    u32 light_id;
+    // Reciprocal of the expected number of times the light is picked
+    f32 inv_pdf;
+  };
+  // Picks the lights a shading point sends visibility rays to
+  void select_lights(Scene &scene, Path_Sampler &sampler,
+                     std::vector<Light_Sample> &point_samples,
+                     std::vector<Light_Sample> &dir_samples,
+                     std::vector<Light_Sample> &plane_samples) {
+    point_samples.clear();
+    dir_samples.clear();
+    plane_samples.clear();
+    if (light_table.empty()) {
+      for (auto light_id : point_lights)
+        point_samples.push_back({light_id, 1.0f});
+      for (auto light_id : dir_lights)
+        dir_samples.push_back({light_id, 1.0f});
+      for (auto light_id : plane_lights)
+        plane_samples.push_back({light_id, 1.0f});
+      return;
+    }
+    ito(light_samples) {
+      vec2 xi = sampler.get_2d();
+      u32 id = light_table.sample(xi.x, xi.y);
+      Light_Sample sample{
+          .light_id = id + 1,
+          .inv_pdf = 1.0f / (light_table.pdf[id] * f32(light_samples))};
+      auto &light = scene.light_sources[id];
+      if (light.type == Light_Type::POINT) {
+        point_samples.push_back(sample);
+      } else if (light.type == Light_Type::PLANE) {
+        plane_samples.push_back(sample);
+      } else if (light.type == Light_Type::DIRECTIONAL) {
+        dir_samples.push_back(sample);
+      }
+    }
+  }
+  // Upper bound on the jobs that shading one job enqueues: a bounce or pass
+  // through ray, an env light ray and a ray per selected light
+  u32 max_spawned_jobs() {
+    u32 lights = light_table.empty()
+                     ? u32(point_lights.size() + dir_lights.size() +
+                           plane_lights.size())
+                     : light_samples;
+    return 2 + lights;
+  }
+  std::vector<ISPC_Packed_Instance> ispc_instances;
 
+  // Processes the whole queue, up to max_jobs_per_iter jobs
   void path_tracing_iteration(Scene &scene) {
+    path_tracing_step(scene, max_jobs_per_iter, max_queue_size);
+    path_tracing_image.resolve();
+  }
+  // Runs small steps until budget_ms is spent so that the caller keeps its
+  // frame rate. A step takes as many jobs as ms_per_job says fit in the
+  // remaining time and only generates the camera tiles it can afford, the
+  // rest of the work stays queued for the next call
+  void path_tracing_iteration_budgeted(Scene &scene, f32 budget_ms) {
+    auto begin = std::chrono::high_resolution_clock::now();
+    auto get_elapsed_ms = [](auto since) {
+      return std::chrono::duration<float, std::milli>(
+                 std::chrono::high_resolution_clock::now() - since)
+          .count();
+    };
+    while (has_work()) {
+      f32 remaining_ms = budget_ms - get_elapsed_ms(begin);
+      if (remaining_ms <= 0.0f)
+        break;
+      // The first step only measures the cost of one stream
+      u32 max_jobs = Ray_Stream::CAPACITY;
+      if (ms_per_job > 0.0f)
+        max_jobs = u32(glm::clamp(remaining_ms / ms_per_job,
+                                  f32(Ray_Stream::CAPACITY),
+                                  f32(max_jobs_per_iter)));
+      auto step_begin = std::chrono::high_resolution_clock::now();
+      path_tracing_step(scene, max_jobs, max_jobs);
+      u32 jobs = stats.primary_rays + stats.secondary_rays + stats.shadow_rays;
+      if (jobs) {
+        f32 cost = get_elapsed_ms(step_begin) / f32(jobs);
+        ms_per_job =
+            ms_per_job == 0.0f ? cost : glm::mix(ms_per_job, cost, 0.25f);
+      }
+    }
+    path_tracing_image.resolve();
+  }
+  // One round of generate/trace/shade
+  // Takes at most max_jobs jobs off the queue and generates camera rays while
+  // the queue is below queue_limit and half of max_queue_size
+  void path_tracing_step(Scene &scene, u32 max_jobs, u64 queue_limit) {
     // This function executes in 3 steps
     // 1: Generate ray tracing job chunks
     // 2: Perform ray-scene test for each ray
@@ -641,11 +2502,8 @@ struct PT_Manager {
       if (scene.spheremap.data.empty()) {
         return vec4(0.0f, 0.0f, 0.0f, 1.0f);
       }
-      float theta = std::acos(ray_dir.y);
-      vec2 xy = glm::normalize(vec2(ray_dir.z, -ray_dir.x));
-      float phi = -std::atan2(xy.x, xy.y);
-      return vec4(color, 1.0f) * scene.spheremap.sample(vec2(
-                                     (phi / M_PI / 2.0f) + 0.5f, theta / M_PI));
+      return vec4(color, 1.0f) *
+             scene.spheremap.sample(Env_Sampler::dir_to_uv(ray_dir));
     };
     // Each light type is handled separately
     point_lights.clear();
@@ -661,644 +2519,652 @@ struct PT_Manager {
         dir_lights.push_back(i + 1);
       }
     }
+    // Visiting every light is cheaper when there are few of them
+    if (sample_lights && light_samples > 0 &&
+        scene.light_sources.size() > light_samples) {
+      std::vector<f32> light_weights(scene.light_sources.size());
+      ito(scene.light_sources.size()) {
+        auto &light = scene.light_sources[i];
+        f32 weight = glm::dot(light.power, vec3(0.2126f, 0.7152f, 0.0722f));
+        if (light.type == Light_Type::PLANE) {
+          weight *= 4.0f * glm::length(light.plane_light.up) *
+                    glm::length(light.plane_light.right);
+        }
+        light_weights[i] = std::max(weight, 0.0f);
+      }
+      light_table.build(light_weights);
+    } else {
+      light_table = Alias_Table{};
+    }
 
     const u32 LIGHT_FLAG = 1u << 31u;
+    path_tracing_queue.reset_peak();
+    {
+      auto generate_begin = std::chrono::high_resolution_clock::now();
+      generate_primary_rays(std::min<u64>(queue_limit, max_queue_size / 2));
+      stats.generate_ms = std::chrono::duration<float, std::milli>(
+                              std::chrono::high_resolution_clock::now() -
+                              generate_begin)
+                              .count();
+    }
+    stats.primary_rays = 0;
+    stats.secondary_rays = 0;
+    stats.shadow_rays = 0;
+    stats.shade_ms = 0.0f;
     if (trace_ispc) {
-      u32 jobs_sofar = max_jobs_per_iter;
-      if (ray_jobs.size() < max_jobs_per_iter) {
-        ray_jobs.resize(max_jobs_per_iter);
-        ray_dirs.resize(max_jobs_per_iter);
-        ray_origins.resize(max_jobs_per_iter);
-        ray_collisions.resize(max_jobs_per_iter);
-      }
-      // Grab ray job items off the queue
-      path_tracing_queue.dequeue(ray_jobs, jobs_sofar);
-      ito(jobs_sofar) {
-        ray_dirs[i] = ray_jobs[i].ray_dir;
-        ray_origins[i] = ray_jobs[i].ray_origin;
-        ray_collisions[i].t = FLT_MAX;
+      // Consumer side back-pressure: a shaded job enqueues at most
+      // max_spawned_jobs jobs, so only take as many as there is room for
+      // under max_queue_size. Visibility rays spawn nothing and always go.
+      // One job is taken on a full queue so that it keeps draining
+      u64 queue_room = max_queue_size > path_tracing_queue.size()
+                           ? max_queue_size - path_tracing_queue.size()
+                           : 0;
+      u32 spawning_budget =
+          u32(std::max<u64>(1, std::min<u64>(max_jobs, queue_room /
+                                                 (max_spawned_jobs() - 1))));
+      auto take_budget = [&](std::vector<std::unique_ptr<Ray_Stream>> &out,
+                             u32 max_count) {
+        u32 first = out.size();
+        u32 count =
+            path_tracing_queue.dequeue(out, max_count, spawning_budget);
+        for (u32 i = first; i < out.size(); i++)
+          if (!out[i]->occlusion)
+            spawning_budget -= out[i]->size;
+        return count;
+      };
+      // Grab ray streams off the queue
+      ray_streams.clear();
+      u32 jobs_sofar = take_budget(ray_streams, max_jobs);
+      // Jobs taken off the queue by kind
+      std::atomic<u32> primary_count = 0;
+      std::atomic<u32> secondary_count = 0;
+      std::atomic<u32> shadow_count = 0;
+      auto count_stream = [&](Ray_Stream const &stream) {
+        if (stream.occlusion) {
+          shadow_count += stream.size;
+          return;
+        }
+        u32 primary = 0;
+        ito(stream.size) if (stream.depth[i] == 0) primary++;
+        primary_count += primary;
+        secondary_count += stream.size - primary;
+      };
+      for (auto &stream : ray_streams)
+        count_stream(*stream);
+
+      ispc_instances.clear();
+      for (auto &node : scene.scene_nodes)
+        ispc_instances.push_back(ispc_pack_instance(
+            node, scene.meshes[node.mesh_id], scene.accel_type));
+      // Ray-scene test for one stream
+      auto trace_stream = [&scene, this, LIGHT_FLAG](Ray_Stream &stream) {
+        auto rays = stream.get_packed_rays();
+        if (stream.occlusion) {
+          if (!scene.tlas.nodes.empty()) {
+            uint _tmp = stream.size;
+            ispc_occluded(&scene.tlas.nodes[0], &scene.tlas.ids[0],
+                          &ispc_instances[0], &rays, &stream.collisions[0],
+                          &_tmp);
+          } else {
+            ito(stream.size) stream.collisions[i] =
+                Collision{.mesh_id = 0u, .t = stream.t_max[i]};
+          }
+        } else {
+          ito(stream.size) stream.collisions[i].t = FLT_MAX;
+          if (!scene.tlas.nodes.empty()) {
+            uint _tmp = stream.size;
+            if (packet_tracing && stream.coherent) {
+              ispc_trace_scene_packets(&scene.tlas.nodes[0],
+                                       &scene.tlas.ids[0], &ispc_instances[0],
+                                       &rays, &stream.collisions[0], &_tmp);
+            } else {
+              ispc_trace_scene(&scene.tlas.nodes[0], &scene.tlas.ids[0],
+                               &ispc_instances[0], &rays,
+                               &stream.collisions[0], &_tmp);
+            }
+          }
+        }
+        // Plane lights are hit by camera rays and occlude visibility rays
+        for (auto &light_id : plane_lights) {
+          uint fictional_id = light_id | LIGHT_FLAG;
+          auto &light = scene.light_sources[light_id - 1];
+          vec3 dir = glm::normalize(
+              glm::cross(light.plane_light.up, light.plane_light.right));
+          uint _tmp = stream.size;
+          ispc_trace_plane(&fictional_id, &light.plane_light.position, &dir,
+                           &light.plane_light.up, &light.plane_light.right,
+                           &rays, &stream.collisions[0], &_tmp);
+        }
+      };
+      if (sort_rays && jobs_sofar > 0) {
+        auto sort_begin = std::chrono::high_resolution_clock::now();
+        sort_ray_streams(scene);
+        stats.sort_ms = std::chrono::duration<float, std::milli>(
+                            std::chrono::high_resolution_clock::now() -
+                            sort_begin)
+                            .count();
+      } else {
+        stats.sort_ms = 0.0f;
       }
-
+      std::atomic<u64> path_segments = 0;
+      std::atomic<u64> camera_rays = 0;
+      std::atomic<u32> rr_terminated = 0;
+      // Handles the hit/miss events of a traced stream, the rays it spawns go
+      // back to the queue
+      auto shade_stream = [this, &scene, env_value, &path_segments,
+                           &camera_rays, &rr_terminated](Ray_Stream &stream) {
+        u64 local_segments = 0;
+        u64 local_camera_rays = 0;
+        u32 local_rr_terminated = 0;
+        // New rays go into streams owned by this work item
+        Ray_Stream_Writer new_jobs(path_tracing_queue);
+        // Point/directional light visibility rays
+        Ray_Stream_Writer shadow_jobs(path_tracing_queue, true);
+        bool sample_env =
+            env_sampling && !scene.env_sampler.empty();
+        std::vector<Light_Sample> point_samples, dir_samples,
+            plane_samples;
+        // Surfaces are shaded in batches, sampling runs in
+        // ispc_shade_surfaces and the scalar code spawns the rays
+        auto surface_batch = alloc_surface_batch();
+        auto shade_batch = [&] {
+          auto &batch = *surface_batch;
+          if (batch.size == 0)
+            return;
+          if (shade_ispc) {
+            ISPC_Packed_Surfaces packed = batch.get_packed();
+            ispc_shade_surfaces(&packed, &batch.size);
+          } else {
+            ito(batch.size) batch.shade_scalar(i);
+          }
+          // Light rays are weighted in one go once the batch is full or
+          // every hit has picked its lights
+          auto &light_rays = batch.light_rays;
+          auto emit_light_rays = [&] {
+            if (light_rays.size == 0)
+              return;
+            if (shade_ispc) {
+              ISPC_Packed_Surfaces packed_surfaces = batch.get_packed();
+              ISPC_Packed_Light_Rays packed = light_rays.get_packed();
+              ispc_eval_light_rays(&packed_surfaces, &packed,
+                                   &light_rays.size);
+            } else {
+              ito(light_rays.size) batch.eval_light_ray_scalar(i);
+            }
+            for (u32 k = 0; k < light_rays.size; k++) {
+              u32 i = light_rays.surface[k];
+              vec3 origin = Surface_Batch::get(batch.origin, i);
+              vec3 L = Light_Ray_Batch::get(light_rays.dir, k);
+              auto new_job = batch.jobs[i];
+              new_job.ray_origin = origin;
+              new_job.ray_dir = L;
+              new_job.weight = 0.0f;
+              new_job.light_id = light_rays.light_id[k];
+              new_job.depth += 1;
+              new_job._depth += 1;
+              new_job.color = Light_Ray_Batch::get(light_rays.color, k);
+              new_job.t_max = light_rays.t_max[k];
+              // Plane lights are found by tracing, the rest only needs
+              // a visibility test
+              if (light_rays.kind[k] == Light_Ray_Batch::LIGHT_RAY_AREA)
+                new_jobs.push(new_job);
+              else
+                shadow_jobs.push(new_job);
+              // #Debug
+              if (path_tracing_camera._grab_path &&
+                  light_rays.kind[k] != Light_Ray_Batch::LIGHT_RAY_ENV) {
+                path_tracing_camera.push_debug_line(origin,
+                                                    origin + L * 100.0f);
+              }
+            }
+            light_rays.size = 0;
+          };
+          auto push_light_ray = [&](u32 i, u32 kind, vec3 L, f32 scale,
+                                    f32 env_pdf, u32 light_id, f32 t_max) {
+            if (light_rays.full())
+              emit_light_rays();
+            light_rays.push(i, kind, L, scale, env_pdf, light_id, t_max);
+          };
+          for (u32 i = 0; i < batch.size; i++) {
+            auto const &job = batch.jobs[i];
+            auto &sampler = batch.samplers[i];
+            vec3 vertex_normal = Surface_Batch::get(batch.normal, i);
+            vec3 origin = Surface_Batch::get(batch.origin, i);
+            vec3 N = Surface_Batch::get(batch.shading_normal, i);
+            vec3 albedo = Surface_Batch::get(batch.albedo, i);
+            float NoV = batch.nov[i];
+            bool specular =
+                batch.lobe[i] != Surface_Batch::LOBE_DIFFUSE;
+            // For image denoising
+            if (job.depth == 0) {
+              path_tracing_image.add_normal(job.pixel_x, job.pixel_y,
+                                            N);
+              path_tracing_image.add_albedo(job.pixel_x, job.pixel_y,
+                                            albedo);
+              path_tracing_image.add_position(
+                  job.pixel_x, job.pixel_y,
+                  Surface_Batch::get(batch.position, i));
+              path_tracing_image.add_vertex_normal(job.pixel_x, job.pixel_y,
+                                                   vertex_normal);
+            }
+            select_lights(scene, sampler, point_samples, dir_samples,
+                          plane_samples);
+            // Spawn a GI ray
+            if (batch.lobe[i] ==
+                Surface_Batch::LOBE_SPECULAR_ABSORBED) {
+              // The reflected ray is under the surface
+              // @TODO: Decide what to do here
+              path_tracing_image.add_value(
+                  job.pixel_x, job.pixel_y, job.sample_id,
+                  vec4(0.0f, 0.0f, 0.0f, job.weight));
+            } else {
+              auto new_job = job;
+              new_job.ray_dir = Surface_Batch::get(batch.dir, i);
+              new_job.ray_origin = origin;
+              new_job.light_id = 0;
+              new_job.depth += 1;
+              new_job._depth += 1;
+              new_job.color = Surface_Batch::get(batch.color, i);
+              new_job.bsdf_pdf = sample_env ? batch.pdf[i] : 0.0f;
+              new_job.cone_spread = batch.spread[i];
+              // #Debug
+              if (path_tracing_camera._grab_path) {
+                path_tracing_camera.push_debug_line(origin,
+                                                    origin + N);
+                path_tracing_camera.push_debug_line(
+                    origin, origin + vertex_normal);
+                path_tracing_camera.push_debug_line(
+                    origin,
+                    origin + Surface_Batch::get(batch.binormal, i));
+                path_tracing_camera.push_debug_line(
+                    origin,
+                    origin + Surface_Batch::get(batch.tangent, i));
+                path_tracing_camera.push_debug_line(job.ray_origin,
+                                                    origin);
+              }
+              new_jobs.push(new_job);
+            }
+            // Pick an env light direction
+            if (sample_env && (!specular || NoV > 0.0f)) {
+              f32 env_pdf = 0.0f;
+              vec3 L = scene.env_sampler.sample(sampler.get_2d(),
+                                                env_pdf);
+              if (saturate(dot(N, L)) > 0.0f && env_pdf > 0.0f) {
+                push_light_ray(i, Light_Ray_Batch::LIGHT_RAY_ENV, L, 1.0f,
+                               env_pdf, ENV_LIGHT_ID, job.t_max);
+              }
+            }
+            // Pick the light directions
+            for (auto &light_sample : point_samples) {
+              u32 light_id = light_sample.light_id;
+              auto &light = scene.light_sources[light_id - 1];
+              vec3 L =
+                  glm::normalize(light.point_light.position - origin);
+              if (saturate(glm::dot(L, N)) > 0.0f) {
+                push_light_ray(
+                    i, Light_Ray_Batch::LIGHT_RAY_DIRECT, L,
+                    light_sample.inv_pdf, 0.0f, light_id,
+                    glm::length(light.point_light.position - origin) *
+                        (1.0f - FLOAT_EPS));
+              }
+            }
+            for (auto &light_sample : dir_samples) {
+              u32 light_id = light_sample.light_id;
+              auto &light = scene.light_sources[light_id - 1];
+              vec3 L = -light.dir_light.direction;
+              if (saturate(glm::dot(L, N)) > 0.0f) {
+                push_light_ray(i, Light_Ray_Batch::LIGHT_RAY_DIRECT, L,
+                               light_sample.inv_pdf, 0.0f, light_id,
+                               job.t_max);
+              }
+            }
+            for (auto &light_sample : plane_samples) {
+              u32 light_id = light_sample.light_id;
+              auto &light = scene.light_sources[light_id - 1];
+              // Uniform in the solid angle of the light
+              auto rect =
+                  light.plane_light.get_spherical_rect(origin);
+              float solid_angle = rect.S;
+              vec3 L = glm::normalize(rect.sample(sampler.get_2d()) -
+                                      origin);
+              if (saturate(glm::dot(L, N)) > 0.0f &&
+                  solid_angle > 1.0e-6f && (!specular || NoV > 0.0f)) {
+                // The pdf is 1 / solid_angle
+                push_light_ray(i, Light_Ray_Batch::LIGHT_RAY_AREA, L,
+                               light_sample.inv_pdf * solid_angle, 0.0f,
+                               light_id, job.t_max);
+              }
+            }
+          }
+          emit_light_rays();
+          batch.size = 0;
+        };
+        for (u32 i = 0; i < stream.size; i++) {
+          auto job = stream.get(i);
+          auto min_col = stream.collisions[i];
+          if (job.light_id == 0u) {
+            local_segments++;
+            if (job._depth == 0)
+              local_camera_rays++;
+          }
+          if (job.light_id == ENV_LIGHT_ID) {
+            // The env light is visible when the ray escapes
+            if (min_col.mesh_id == 0u) {
+              path_tracing_image.add_value(
+                  job.pixel_x, job.pixel_y, job.sample_id,
+                  vec4(vec3(env_value(job.ray_dir, job.color)),
+                       job.weight));
+            }
+          } else if (job.light_id != 0u) {
+            auto &light = scene.light_sources[job.light_id - 1];
+            bool is_light = (min_col.mesh_id & LIGHT_FLAG) != 0u;
+            auto col_light_id = min_col.mesh_id & (LIGHT_FLAG - 1u);
+            // Point/directional visibility rays come from
+            // occlusion streams, mesh_id is set on any hit before
+            // t_max
+            bool occluded = min_col.mesh_id != 0u;
+            if (light.type == Light_Type::POINT) {
+              float dist = glm::length(job.ray_origin -
+                                       light.point_light.position);
+              if (!occluded) {
+                float falloff = 1.0f / (dist * dist);
+                // Visibility check succeeded
+                path_tracing_image.add_value(
+                    job.pixel_x, job.pixel_y, job.sample_id,
+                    vec4(falloff * job.color * light.power,
+                         job.weight));
+              }
+            } else if (light.type == Light_Type::PLANE) {
+              if (is_light && col_light_id == job.light_id) {
+                // Visibility check succeeded
+                path_tracing_image.add_value(
+                    job.pixel_x, job.pixel_y, job.sample_id,
+                    vec4(job.color * light.power, job.weight));
+              } else {
+                path_tracing_image.add_value(
+                    job.pixel_x, job.pixel_y, job.sample_id,
+                    vec4(0.0f, 0.0f, 0.0f, job.weight));
+              }
+            } else if (light.type == Light_Type::DIRECTIONAL) {
+              if (!occluded) {
+                // Visibility check succeeded
+                path_tracing_image.add_value(
+                    job.pixel_x, job.pixel_y, job.sample_id,
+                    vec4(job.color * light.power, job.weight));
+              } else {
+                path_tracing_image.add_value(
+                    job.pixel_x, job.pixel_y, job.sample_id,
+                    vec4(0.0f, 0.0f, 0.0f, job.weight));
+              }
+            } else {
+              ASSERT_PANIC(false && "Unsupported ligth type");
+            }
+            // Visibility check failed
+          } else if (min_col.t < FLT_MAX) {
+            if (job.depth == max_depth) {
+              // Terminate
+              path_tracing_image.add_value(
+                  job.pixel_x, job.pixel_y, job.sample_id,
+                  vec4(0.0f, 0.0f, 0.0f, job.weight));
+            } else if ((min_col.mesh_id & LIGHT_FLAG) != 0u &&
+                       job.light_id == 0u) {
+              u32 light_id = min_col.mesh_id & (LIGHT_FLAG - 1u);
+              auto &light = scene.light_sources[light_id - 1];
+              // if (job.depth == 0) {
+              // For primary rays we add the radiance
+              path_tracing_image.add_value(
+                  job.pixel_x, job.pixel_y, job.sample_id,
+                  vec4(light.power * job.color, 2.0f * job.weight));
+              //                        } else {
+              //                          // Terminate
+              //                          path_tracing_image.add_value(
+              //                              job.pixel_x,
+              //                              job.pixel_y, vec4(0.0f,
+              //                              0.0f, 0.0f,
+              //                              job.weight));
+              //                        }
+            } else {
+              auto &node = scene.scene_nodes[min_col.mesh_id - 1];
+              auto face =
+                  scene.meshes[node.mesh_id].indices[min_col.face_id];
+              vec2 uv = vec2(min_col.u, min_col.v);
+              auto vertex = scene.get_interpolated_vertex(
+                  node, min_col.face_id, uv);
+
+              // Footprint of the ray cone at the hit
+              job.cone_width += job.cone_spread * min_col.t;
+              f32 lod = scene.get_texture_lod(
+                  node, min_col.face_id, job.ray_dir,
+                  job.cone_width);
+              auto &mat = scene.pbr_model.materials[node.material_id];
+              vec4 albedo = mat.albedo_factor;
+              if (mat.albedo_id >= 0) {
+                albedo = mat.albedo_factor *
+                         scene.textures[mat.albedo_id].sample(
+                             vertex.texcoord, lod);
+              }
+
+              if (glm::dot(job.ray_dir, vertex.normal) > 0.0f) {
+                if (job._depth < max_depth + 4) {
+                  job.ray_origin =
+                      vertex.position + vertex.normal * 1.0e-3f;
+                  job._depth += 1;
+                  new_jobs.push(job);
+                }
+              } else if (albedo.a < 0.5f) {
+                if (job._depth < max_depth + 1) {
+                  job.ray_origin =
+                      vertex.position - vertex.normal * 1.0e-3f;
+                  job._depth += 1;
+                  new_jobs.push(job);
+                }
+              } else {
+                auto sampler = get_sampler(
+                    job.pixel_x, job.pixel_y, job.sample_id,
+                    (job._depth + 1) * SAMPLER_DIMENSIONS_PER_BOUNCE);
+                if (russian_roulette && job.depth >= rr_min_depth) {
+                  // Survive with a probability proportional to the
+                  // throughput and reweight the survivors
+                  f32 p = glm::clamp(
+                      std::max(job.color.x,
+                               std::max(job.color.y, job.color.z)),
+                      0.05f, 1.0f);
+                  if (sampler.get_1d() >= p) {
+                    local_rr_terminated++;
+                    path_tracing_image.add_value(
+                        job.pixel_x, job.pixel_y, job.sample_id,
+                        vec4(0.0f, 0.0f, 0.0f, job.weight));
+                    continue;
+                  }
+                  job.color *= 1.0f / p;
+                }
+                vec4 normal_map = vec4(0.5f, 0.5f, 1.0f, 0.0f);
+                if (mat.normal_id >= 0) {
+                  normal_map = scene.textures[mat.normal_id].sample(
+                      vertex.texcoord, lod);
+                }
+                vec4 arm = vec4(1.0f, mat.roughness_factor,
+                                mat.metal_factor, 1.0f);
+                if (mat.arm_id >= 0) {
+                  arm =
+                      arm * scene.textures[mat.arm_id].sample(
+                                vertex.texcoord, lod);
+                }
+                surface_batch->push(job, sampler, vertex,
+                                    vec3(albedo), vec3(normal_map),
+                                    std::max(arm.g, 1.0e-5f), arm.b);
+                if (surface_batch->size == Surface_Batch::CAPACITY)
+                  shade_batch();
+              }
+            }
+          } else {
+            // #Debug
+            if (path_tracing_camera._grab_path) {
+              path_tracing_camera.push_debug_line(
+                  job.ray_origin,
+                  job.ray_origin + job.ray_dir * 1000.0f);
+            }
+            if (job.depth == 0) {
+              path_tracing_image.add_value(
+                  job.pixel_x, job.pixel_y, job.sample_id,
+                  vec4(0.5f, 0.5f, 0.5f, job.weight));
+            } else {
+              vec3 color = job.color;
+              if (job.bsdf_pdf > 0.0f) {
+                color *= mis_weight(
+                    job.bsdf_pdf,
+                    scene.env_sampler.get_pdf(job.ray_dir));
+              }
+              path_tracing_image.add_value(
+                  job.pixel_x, job.pixel_y, job.sample_id,
+                  job.weight * env_value(job.ray_dir, color));
+            }
+          }
+        }
+        shade_batch();
+        release_surface_batch(std::move(surface_batch));
+        path_segments += local_segments;
+        camera_rays += local_camera_rays;
+        rr_terminated += local_rr_terminated;
+      };
+      // Worker time spent in the tasks of each stage, the rest of the stage
+      // wall time times the worker count is idle
+      std::atomic<u64> trace_busy_ns = 0;
+      std::atomic<u64> shade_busy_ns = 0;
+      auto run_timed = [](std::atomic<u64> &busy_ns, auto &&func) {
+        auto begin = std::chrono::high_resolution_clock::now();
+        func();
+        busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::high_resolution_clock::now() - begin)
+                       .count();
+      };
+      u32 worker_count = u32(std::max(1, scheduler.getWorkerThreadCount()));
+      stats.idle_ms = 0.0f;
       // @PathTracing
-      if (jobs_sofar > 0) {
-        if (use_jobs) {
-
-          WorkPayload work_payload;
-          work_payload.reserve((jobs_sofar + jobs_per_item - 1) /
-                               jobs_per_item);
-          ito((jobs_sofar + jobs_per_item - 1) / jobs_per_item) {
-            work_payload.push_back(JobPayload{
-                .func =
-                    [&scene, this](JobDesc desc) {
-                      for (auto &node : scene.scene_nodes) {
-                        ISPC_Packed_UG ispc_packed_ug;
-                        ispc_packed_ug.ids = &node.packed_ug.ids[0];
-                        ispc_packed_ug.bins_indices =
-                            &node.packed_ug.arena_table[0];
-                        memcpy(ispc_packed_ug._min, &node.packed_ug.min, 12);
-                        memcpy(ispc_packed_ug._max, &node.packed_ug.max, 12);
-                        memcpy(ispc_packed_ug.invtransform,
-                               &glm::transpose(node.invtransform)[0][0], 64);
-                        memcpy(ispc_packed_ug.bin_count,
-                               &node.packed_ug.bin_count, 12);
-                        ispc_packed_ug.bin_size = node.packed_ug.bin_size;
-                        ispc_packed_ug.mesh_id = node.id;
-                        uint _tmp = desc.size;
-                        ispc_trace(
-                            &ispc_packed_ug, (void *)&node.positions_flat[0],
-                            (uint *)&node.indices[0], &ray_dirs[desc.offset],
-                            &ray_origins[desc.offset],
-                            &ray_collisions[desc.offset], &_tmp);
-                      }
-                      for (auto &light_id : plane_lights) {
-                        uint fictional_id = light_id | LIGHT_FLAG;
-                        auto &light = scene.light_sources[light_id - 1];
-                        vec3 dir = glm::normalize(glm::cross(
-                            light.plane_light.up, light.plane_light.right));
-                        uint _tmp = desc.size;
-                        ispc_trace_plane(
-                            &fictional_id, &light.plane_light.position, &dir,
-                            &light.plane_light.up, &light.plane_light.right,
-                            &ray_dirs[desc.offset], &ray_origins[desc.offset],
-                            &ray_collisions[desc.offset], &_tmp);
-                      }
-                    },
-                .desc = JobDesc{
-                    .offset = i * jobs_per_item,
-                    .size = std::min(u32(jobs_sofar) - i * jobs_per_item,
-                                     jobs_per_item)}});
+      if (jobs_sofar > 0 && pipeline_streams && use_jobs) {
+        // Each stream is traced and shaded by one task without waiting for
+        // the other streams. When a task is done the freed slot takes the
+        // next stream, the streams spawned by shading included, until
+        // max_jobs jobs are taken. So secondary rays don't wait for the next
+        // call and no worker waits at the end of a stage
+        auto pipeline_begin = std::chrono::high_resolution_clock::now();
+        u32 max_in_flight = worker_count * std::max(1u, streams_per_worker);
+        std::atomic<u32> in_flight = 0;
+        std::atomic<u32> next_stream = 0;
+        std::atomic<u64> jobs_taken = jobs_sofar;
+        // Streams of this step first, then the queue. The queue is read one
+        // stream at a time so the step goes over max_jobs by less than a
+        // stream per slot
+        std::mutex take_mutex;
+        auto take_stream = [&]() -> Ray_Stream * {
+          u32 stream_id = next_stream++;
+          if (stream_id < ray_streams.size())
+            return ray_streams[stream_id].release();
+          // The budget is shared by the slots
+          std::scoped_lock<std::mutex> sl(take_mutex);
+          if (jobs_taken >= max_jobs)
+            return nullptr;
+          std::vector<std::unique_ptr<Ray_Stream>> taken;
+          u32 count = take_budget(taken, 1);
+          if (!count)
+            return nullptr;
+          jobs_taken += count;
+          count_stream(*taken[0]);
+          return taken[0].release();
+        };
+        marl::WaitGroup wg;
+        std::function<void()> fill_pipeline;
+        fill_pipeline = [&] {
+          // Every increment holds a slot until its stream is shaded
+          while (in_flight.fetch_add(1) < max_in_flight) {
+            Ray_Stream *stream = take_stream();
+            if (!stream)
+              break;
+            wg.add();
+            marl::schedule([&, stream] {
+              defer(wg.done());
+              std::unique_ptr<Ray_Stream> owned(stream);
+              run_timed(trace_busy_ns, [&] {
+                // Streams spawned during the step missed sort_ray_streams
+                if (sort_rays && !owned->coherent)
+                  owned = sort_ray_stream(scene, std::move(owned));
+                trace_stream(*owned);
+              });
+              run_timed(shade_busy_ns, [&] { shade_stream(*owned); });
+              path_tracing_queue.release_stream(std::move(owned));
+              in_flight--;
+              fill_pipeline();
+            });
           }
-          marl::WaitGroup wg(work_payload.size());
-
-          for (u32 i = 0; i < work_payload.size(); i++) {
-            marl::schedule([=] {
+          in_flight--;
+        };
+        fill_pipeline();
+        wg.wait();
+        // A slot may give up while another task is still enqueueing, the
+        // streams it left go back to the queue for the next step
+        for (auto &stream : ray_streams)
+          if (stream)
+            path_tracing_queue.enqueue(std::move(stream));
+        ray_streams.clear();
+        f32 pipeline_ms = std::chrono::duration<float, std::milli>(
+                              std::chrono::high_resolution_clock::now() -
+                              pipeline_begin)
+                              .count();
+        // The stages overlap, report their share of the wall time
+        stats.trace_ms = f32(trace_busy_ns) * 1.0e-6f / f32(worker_count);
+        stats.shade_ms = f32(shade_busy_ns) * 1.0e-6f / f32(worker_count);
+        stats.idle_ms = std::max(0.0f, pipeline_ms * f32(worker_count) -
+                                           f32(trace_busy_ns + shade_busy_ns) *
+                                               1.0e-6f);
+        stats.traced_rays = u32(jobs_taken);
+        f32 total_ms = pipeline_ms + stats.sort_ms;
+        stats.rays_per_sec =
+            total_ms > 0.0f ? f32(jobs_taken) / total_ms * 1.0e3f : 0.0f;
+        auto &avg = stats.avg_rays_per_sec[sort_rays ? 1 : 0];
+        avg = avg == 0.0f ? stats.rays_per_sec
+                          : glm::mix(avg, stats.rays_per_sec, 0.05f);
+      } else if (jobs_sofar > 0) {
+        auto trace_begin = std::chrono::high_resolution_clock::now();
+        if (use_jobs) {
+          marl::WaitGroup wg(ray_streams.size());
+          for (u32 i = 0; i < ray_streams.size(); i++) {
+            marl::schedule([=, &trace_busy_ns] {
               defer(wg.done());
-
-              auto work = work_payload[i];
-              work.func(work.desc);
+              run_timed(trace_busy_ns,
+                        [&] { trace_stream(*ray_streams[i]); });
             });
           }
           wg.wait();
         } else {
-          for (auto &node : scene.scene_nodes) {
-            ISPC_Packed_UG ispc_packed_ug;
-            ispc_packed_ug.ids = &node.packed_ug.ids[0];
-            ispc_packed_ug.bins_indices = &node.packed_ug.arena_table[0];
-            memcpy(ispc_packed_ug._min, &node.packed_ug.min, 12);
-            memcpy(ispc_packed_ug._max, &node.packed_ug.max, 12);
-            memcpy(ispc_packed_ug.invtransform,
-                   &glm::transpose(node.invtransform)[0][0], 64);
-            memcpy(ispc_packed_ug.bin_count, &node.packed_ug.bin_count, 12);
-            ispc_packed_ug.bin_size = node.packed_ug.bin_size;
-            ispc_packed_ug.mesh_id = node.id;
-            uint _tmp = jobs_sofar;
-            ispc_trace(&ispc_packed_ug, (void *)&node.positions_flat[0],
-                       (uint *)&node.indices[0], &ray_dirs[0], &ray_origins[0],
-                       &ray_collisions[0], &_tmp);
-          }
+          for (auto &stream : ray_streams)
+            trace_stream(*stream);
         }
         {
+          auto trace_end = std::chrono::high_resolution_clock::now();
+          stats.traced_rays = jobs_sofar;
+          stats.trace_ms = std::chrono::duration<float, std::milli>(
+                               trace_end - trace_begin)
+                               .count();
+          // Sorting is part of the cost of the sorted mode
+          f32 total_ms = stats.trace_ms + stats.sort_ms;
+          stats.rays_per_sec =
+              total_ms > 0.0f ? f32(jobs_sofar) / total_ms * 1.0e3f : 0.0f;
+          auto &avg = stats.avg_rays_per_sec[sort_rays ? 1 : 0];
+          avg = avg == 0.0f ? stats.rays_per_sec
+                            : glm::mix(avg, stats.rays_per_sec, 0.05f);
+        }
+        {
+          auto shade_begin = std::chrono::high_resolution_clock::now();
           WorkPayload work_payload;
-          ito((jobs_sofar + jobs_per_item - 1) / jobs_per_item) {
+          ito(ray_streams.size()) {
             work_payload.push_back(JobPayload{
-                .func = {[this, &scene, env_value](JobDesc desc) {
-                  for (u32 i = desc.offset; i < desc.offset + desc.size; i++) {
-                    auto job = ray_jobs[i];
-                    auto min_col = ray_collisions[i];
-                    if (job.light_id != 0u) {
-                      auto &light = scene.light_sources[job.light_id - 1];
-                      bool is_light = (min_col.mesh_id & LIGHT_FLAG) != 0u;
-                      auto col_light_id = min_col.mesh_id & (LIGHT_FLAG - 1u);
-                      if (light.type == Light_Type::POINT) {
-                        float dist = glm::length(job.ray_origin -
-                                                 light.point_light.position);
-                        if (min_col.t > dist * (1.0f - FLOAT_EPS)) {
-                          float falloff = 1.0f / (dist * dist);
-                          // Visibility check succeeded
-                          path_tracing_image.add_value(
-                              job.pixel_x, job.pixel_y,
-                              vec4(falloff * job.color * light.power,
-                                   job.weight));
-                        }
-                      } else if (light.type == Light_Type::PLANE) {
-                        if (is_light && col_light_id == job.light_id) {
-                          // Visibility check succeeded
-                          path_tracing_image.add_value(
-                              job.pixel_x, job.pixel_y,
-                              vec4(job.color * light.power, job.weight));
-                        } else {
-                          path_tracing_image.add_value(
-                              job.pixel_x, job.pixel_y,
-                              vec4(0.0f, 0.0f, 0.0f, job.weight));
-                        }
-                      } else if (light.type == Light_Type::DIRECTIONAL) {
-                        if (min_col.t == FLT_MAX) {
-                          // Visibility check succeeded
-                          path_tracing_image.add_value(
-                              job.pixel_x, job.pixel_y,
-                              vec4(job.color * light.power, job.weight));
-                        } else {
-                          path_tracing_image.add_value(
-                              job.pixel_x, job.pixel_y,
-                              vec4(0.0f, 0.0f, 0.0f, job.weight));
-                        }
-                      } else {
-                        ASSERT_PANIC(false && "Unsupported ligth type");
-                      }
-                      // Visibility check failed
-                    } else if (min_col.t < FLT_MAX) {
-                      if (job.depth == max_depth) {
-                        // Terminate
-                        path_tracing_image.add_value(
-                            job.pixel_x, job.pixel_y,
-                            vec4(0.0f, 0.0f, 0.0f, job.weight));
-                      } else if ((min_col.mesh_id & LIGHT_FLAG) != 0u &&
-                                 job.light_id == 0u) {
-                        u32 light_id = min_col.mesh_id & (LIGHT_FLAG - 1u);
-                        auto &light = scene.light_sources[light_id - 1];
-                        // if (job.depth == 0) {
-                        // For primary rays we add the radiance
-                        path_tracing_image.add_value(
-                            job.pixel_x, job.pixel_y,
-                            vec4(light.power * job.color, 2.0f * job.weight));
-                        //                        } else {
-                        //                          // Terminate
-                        //                          path_tracing_image.add_value(
-                        //                              job.pixel_x,
-                        //                              job.pixel_y, vec4(0.0f,
-                        //                              0.0f, 0.0f,
-                        //                              job.weight));
-                        //                        }
-                      } else {
-                        auto &node = scene.scene_nodes[min_col.mesh_id - 1];
-                        auto face = node.indices[min_col.face_id];
-                        vec2 uv = vec2(min_col.u, min_col.v);
-                        auto vertex = scene.get_interpolated_vertex(
-                            node, min_col.face_id, uv);
-
-                        auto &mat = scene.pbr_model.materials[node.material_id];
-                        vec4 albedo = mat.albedo_factor;
-                        if (mat.albedo_id >= 0) {
-                          albedo = mat.albedo_factor *
-                                   scene.pbr_model.images[mat.albedo_id].sample(
-                                       vertex.texcoord);
-                        }
-
-                        if (glm::dot(job.ray_dir, vertex.normal) > 0.0f) {
-                          if (job._depth < max_depth + 4) {
-                            job.ray_origin =
-                                vertex.position + vertex.normal * 1.0e-3f;
-                            job._depth += 1;
-                            path_tracing_queue.enqueue(job);
-                          }
-                        } else if (albedo.a < 0.5f) {
-                          if (job._depth < max_depth + 1) {
-                            job.ray_origin =
-                                vertex.position - vertex.normal * 1.0e-3f;
-                            job._depth += 1;
-                            path_tracing_queue.enqueue(job);
-                          }
-                        } else {
-                          vec4 normal_map = vec4(0.5f, 0.5f, 1.0f, 0.0f);
-                          if (mat.normal_id >= 0) {
-                            normal_map =
-                                scene.pbr_model.images[mat.normal_id].sample(
-                                    vertex.texcoord);
-                          }
-                          vec4 arm = vec4(1.0f, mat.roughness_factor,
-                                          mat.metal_factor, 1.0f);
-                          if (mat.arm_id >= 0) {
-                            arm =
-                                arm * scene.pbr_model.images[mat.arm_id].sample(
-                                          vertex.texcoord);
-                          }
-                          float metalness = arm.b;
-                          float roughness = arm.g;
-                          roughness = std::max(roughness, 1.0e-5f);
-                          vec3 normal = glm::normalize(
-                              (2.0f * normal_map.x - 1.0f) * vertex.tangent +
-                              (2.0f * normal_map.y - 1.0f) * vertex.binormal +
-                              normal_map.z * vertex.normal);
-                          // For image denoising
-                          if (job.depth == 0) {
-                            path_tracing_image.add_normal(job.pixel_x,
-                                                          job.pixel_y, normal);
-                            path_tracing_image.add_albedo(
-                                job.pixel_x, job.pixel_y, vec3(albedo));
-                          }
-                          // PBR Definitions
-                          vec3 N = normal;
-                          vec3 V = -job.ray_dir;
-                          float NoV = saturate(dot(N, V));
-                          u32 secondary_N = 1; // 2 / (1 << job.depth);
-                          kto(secondary_N) {
-                            vec2 xi = frand.random_halton();
-                            // Value used to choose between specular/diffuse
-                            // sample
-                            float Ks =
-                                clamp(metalness + FresnelSchlickRoughness(
-                                                      NoV, DIELECTRIC_SPECULAR,
-                                                      roughness),
-                                      0.0f, 1.0f);
-                            float Kd = 1.0f - Ks;
-                            // Reflectance at 0 theta
-                            vec3 F0 = glm::mix(vec3(DIELECTRIC_SPECULAR),
-                                               vec3(albedo), vec3(metalness));
-                            // Roll a dice and choose between specular and
-                            // diffuse sample based on the fresnel value
-                            if
-                                //                            (true) {
-                                //                                (frand.rand_unit_float()
-                                //                                > 0.5f) {
-                                (Ks > frand.rand_unit_float()) {
-                              // Spawn a GI ray
-                              {
-                                vec3 brdf = vec3(0.0f);
-                                vec3 L =
-                                    sample_ggx(xi, N, V, F0, roughness, brdf);
-                                float NoL = saturate(dot(N, L));
-                                // Means that the reflected ray is under surface
-                                // Should we multiscatter/absorb/reroll?
-                                if (NoL > 0.0f) {
-                                  auto new_job = job;
-                                  new_job.ray_dir = L;
-                                  new_job.ray_origin =
-                                      vertex.position + vertex.normal * 1.0e-3f;
-                                  new_job.weight *= 1.0f / secondary_N;
-                                  new_job.light_id = 0;
-                                  new_job.depth += 1;
-                                  new_job._depth += 1;
-                                  new_job.color =
-                                      (1.0f / Ks) * (brdf * job.color);
-                                  // #Debug
-                                  if (path_tracing_camera._grab_path) {
-                                    path_tracing_camera.push_debug_line(
-                                        new_job.ray_origin,
-                                        new_job.ray_origin + normal * 1.0f);
-                                    path_tracing_camera.push_debug_line(
-                                        new_job.ray_origin,
-                                        new_job.ray_origin +
-                                            vertex.normal * 1.0f);
-                                    path_tracing_camera.push_debug_line(
-                                        new_job.ray_origin,
-                                        new_job.ray_origin +
-                                            vertex.binormal * 1.0f);
-                                    path_tracing_camera.push_debug_line(
-                                        new_job.ray_origin,
-                                        new_job.ray_origin +
-                                            vertex.tangent * 1.0f);
-                                    path_tracing_camera.push_debug_line(
-                                        job.ray_origin, new_job.ray_origin);
-                                  }
-                                  path_tracing_queue.enqueue(new_job);
-                                } else {
-                                  path_tracing_image.add_value(
-                                      job.pixel_x, job.pixel_y,
-                                      vec4(0.0f, 0.0f, 0.0f, job.weight));
-                                  // @TODO: Decide what to do here
-                                }
-                              }
-                              // Spawn specular light rays
-                              {
-                                for (auto &point_light_id : point_lights) {
-                                  auto &light =
-                                      scene.light_sources[point_light_id - 1];
-
-                                  auto new_job = job;
-
-                                  new_job.ray_origin =
-                                      vertex.position + vertex.normal * 1.0e-3f;
-                                  vec3 L = glm::normalize(
-                                      light.point_light.position -
-                                      new_job.ray_origin);
-                                  float NoL = saturate(glm::dot(L, N));
-                                  if (NoL > 0.0f) {
-                                    new_job.ray_dir = L;
-                                    vec3 brdf =
-                                        eval_ggx(N, V, L, roughness, F0);
-                                    new_job.weight = 0.0f;
-                                    new_job.light_id = point_light_id;
-                                    new_job.depth += 1;
-                                    new_job._depth += 1;
-                                    new_job.color =
-                                        (1.0f / Ks) * (brdf * job.color);
-                                    path_tracing_queue.enqueue(new_job);
-                                    // #Debug
-                                    if (path_tracing_camera._grab_path) {
-
-                                      path_tracing_camera.push_debug_line(
-
-                                          new_job.ray_origin,
-                                          new_job.ray_origin + L * 100.0f);
-                                    }
-                                  }
-                                }
-                                for (auto &light_id : dir_lights) {
-                                  auto &light =
-                                      scene.light_sources[light_id - 1];
-
-                                  auto new_job = job;
-
-                                  new_job.ray_origin =
-                                      vertex.position + vertex.normal * 1.0e-3f;
-                                  vec3 L = -light.dir_light.direction;
-                                  float NoL = saturate(glm::dot(L, N));
-                                  if (NoL > 0.0f) {
-                                    new_job.ray_dir = L;
-                                    vec3 brdf =
-                                        eval_ggx(N, V, L, roughness, F0);
-                                    new_job.weight = 0.0f;
-                                    new_job.light_id = light_id;
-                                    new_job.depth += 1;
-                                    new_job._depth += 1;
-                                    new_job.color =
-                                        (1.0f / Ks) * (brdf * job.color);
-                                    path_tracing_queue.enqueue(new_job);
-                                    // #Debug
-                                    if (path_tracing_camera._grab_path) {
-
-                                      path_tracing_camera.push_debug_line(
-
-                                          new_job.ray_origin,
-                                          new_job.ray_origin + L * 100.0f);
-                                    }
-                                  }
-                                }
-                                for (auto &light_id : plane_lights) {
-                                  auto &light =
-                                      scene.light_sources[light_id - 1];
-
-                                  auto new_job = job;
-
-                                  new_job.ray_origin =
-                                      vertex.position + vertex.normal * 1.0e-3f;
-
-                                  vec3 L, brdf;
-                                  if (true) { //(frand.rand_unit_float() <
-                                              // roughness) {
-                                    vec2 xi = frand.random_halton();
-                                    //                                    vec2(frand.rand_unit_float(),
-                                    //                                                   frand.rand_unit_float());
-                                    xi = xi * 2.0f - vec2(1.0f);
-                                    L = glm::normalize(
-                                        (light.plane_light.position +
-                                         light.plane_light.up * xi.y +
-                                         light.plane_light.right * xi.x) -
-                                        new_job.ray_origin);
-                                    brdf = eval_ggx(N, V, L, roughness, F0);
-                                  } else {
-                                    ASSERT_PANIC(false);
-                                    //                                    vec2
-                                    //                                    xi =
-                                    //                                    vec2(frand.rand_unit_float(),
-                                    //                                                   frand.rand_unit_float());
-                                    //                                    L =
-                                    //                                    sample_ggx(xi,
-                                    //                                    N, V,
-                                    //                                    F0,
-                                    //                                    roughness,
-                                    //                                                   brdf);
-                                  }
-                                  float NoL = saturate(glm::dot(L, N));
-
-                                  vec3 points[4] = {
-                                      light.plane_light.position -
-                                          light.plane_light.up -
-                                          light.plane_light.right,
-                                      light.plane_light.position -
-                                          light.plane_light.up +
-                                          light.plane_light.right,
-                                      light.plane_light.position +
-                                          light.plane_light.up +
-                                          light.plane_light.right,
-                                      light.plane_light.position +
-                                          light.plane_light.up -
-                                          light.plane_light.right};
-
-                                  float solid_angle = LTC::plane_solid_angle(
-                                      N, V, vertex.position, points);
-                                  if (NoL > 0.0f && solid_angle > 0.0f) {
-                                    new_job.ray_dir = L;
-                                    new_job.weight = 0.0f;
-                                    new_job.light_id = light_id;
-                                    new_job.depth += 1;
-                                    new_job._depth += 1;
-                                    new_job.color = (1.0f / Ks) *
-                                                    (brdf * job.color) *
-                                                    solid_angle / (2.0f * PI);
-                                    path_tracing_queue.enqueue(new_job);
-                                    // #Debug
-                                    if (path_tracing_camera._grab_path) {
-
-                                      path_tracing_camera.push_debug_line(
-
-                                          new_job.ray_origin,
-                                          new_job.ray_origin + L * 100.0f);
-                                    }
-                                  }
-                                }
-                              }
-                            } else {
-                              // Lambertian diffuse
-
-                              // Spawn GI diffuse ray
-                              {
-                                vec3 up = abs(normal.y) < 0.999
-                                              ? vec3(0.0, 1.0, 0.0)
-                                              : vec3(0.0, 0.0, 1.0);
-                                vec3 tangent =
-                                    glm::normalize(glm::cross(up, normal));
-                                vec3 binormal = glm::cross(tangent, normal);
-                                tangent = glm::cross(binormal, normal);
-                                auto new_job = job;
-                                // Cosine biased sampling
-                                vec3 rand = SampleHemisphere_Cosinus(xi);
-
-                                new_job.ray_dir = glm::normalize(
-                                    tangent * rand.x + binormal * rand.y +
-                                    normal * rand.z);
-                                new_job.ray_origin =
-                                    vertex.position + vertex.normal * 1.0e-3f;
-                                new_job.weight *= 1.0f / secondary_N;
-                                new_job.light_id = 0;
-                                new_job.depth += 1;
-                                new_job._depth += 1;
-                                new_job.color = (1.0f / Kd) * vec3(albedo) *
-                                                (1.0f - DIELECTRIC_SPECULAR) *
-                                                (1.0f - metalness) * job.color;
-                                // #Debug
-                                if (path_tracing_camera._grab_path) {
-                                  path_tracing_camera.push_debug_line(
-                                      new_job.ray_origin,
-                                      new_job.ray_origin + normal * 1.0f);
-                                  path_tracing_camera.push_debug_line(
-                                      new_job.ray_origin,
-                                      new_job.ray_origin +
-                                          vertex.normal * 1.0f);
-                                  path_tracing_camera.push_debug_line(
-                                      new_job.ray_origin,
-                                      new_job.ray_origin +
-                                          vertex.binormal * 1.0f);
-                                  path_tracing_camera.push_debug_line(
-                                      new_job.ray_origin,
-                                      new_job.ray_origin +
-                                          vertex.tangent * 1.0f);
-                                  path_tracing_camera.push_debug_line(
-                                      job.ray_origin, new_job.ray_origin);
-                                }
-                                path_tracing_queue.enqueue(new_job);
-                              }
-                              // Spawn diffuse light rays
-                              {
-                                for (auto &point_light_id : point_lights) {
-                                  auto &light =
-                                      scene.light_sources[point_light_id - 1];
-
-                                  auto new_job = job;
-
-                                  new_job.ray_origin =
-                                      vertex.position + vertex.normal * 1.0e-3f;
-                                  vec3 L = glm::normalize(
-                                      light.point_light.position -
-                                      new_job.ray_origin);
-                                  float NoL = saturate(glm::dot(L, N));
-                                  if (NoL > 0.0f) {
-                                    new_job.ray_dir = L;
-                                    new_job.weight = 0.0f;
-                                    new_job.light_id = point_light_id;
-                                    new_job.depth += 1;
-                                    new_job._depth += 1;
-                                    new_job.color =
-                                        (1.0f / Kd) *
-                                        (NoL * vec3(albedo) *
-                                         (1.0f - DIELECTRIC_SPECULAR) *
-                                         (1.0f - metalness) * job.color);
-                                    path_tracing_queue.enqueue(new_job);
-                                    // #Debug
-                                    if (path_tracing_camera._grab_path) {
-
-                                      path_tracing_camera.push_debug_line(
-
-                                          new_job.ray_origin,
-                                          new_job.ray_origin + L * 100.0f);
-                                    }
-                                  }
-                                }
-                              }
-                              {
-                                for (auto &light_id : dir_lights) {
-                                  auto &light =
-                                      scene.light_sources[light_id - 1];
-
-                                  auto new_job = job;
-
-                                  new_job.ray_origin =
-                                      vertex.position + vertex.normal * 1.0e-3f;
-                                  vec3 L = -light.dir_light.direction;
-                                  float NoL = saturate(glm::dot(L, N));
-                                  if (NoL > 0.0f) {
-                                    new_job.ray_dir = L;
-                                    new_job.weight = 0.0f;
-                                    new_job.light_id = light_id;
-                                    new_job.depth += 1;
-                                    new_job._depth += 1;
-                                    new_job.color =
-                                        (1.0f / Kd) *
-                                        (NoL * vec3(albedo) *
-                                         (1.0f - DIELECTRIC_SPECULAR) *
-                                         (1.0f - metalness) * job.color);
-                                    path_tracing_queue.enqueue(new_job);
-                                    // #Debug
-                                    if (path_tracing_camera._grab_path) {
-
-                                      path_tracing_camera.push_debug_line(
-
-                                          new_job.ray_origin,
-                                          new_job.ray_origin + L * 100.0f);
-                                    }
-                                  }
-                                }
-                              }
-                              for (auto &light_id : plane_lights) {
-                                auto &light = scene.light_sources[light_id - 1];
-
-                                auto new_job = job;
-
-                                new_job.ray_origin =
-                                    vertex.position + vertex.normal * 1.0e-3f;
-                                vec2 xi = frand.random_halton();
-                                //                                vec2(frand.rand_unit_float(),
-                                //                                               frand.rand_unit_float());
-                                xi = xi * 2.0f - vec2(1.0f);
-                                vec3 L = glm::normalize(
-                                    (light.plane_light.position +
-                                     light.plane_light.up * xi.y +
-                                     light.plane_light.right * xi.x) -
-                                    new_job.ray_origin);
-                                float NoL = saturate(glm::dot(L, N));
-                                vec3 points[4] = {light.plane_light.position -
-                                                      light.plane_light.up -
-                                                      light.plane_light.right,
-                                                  light.plane_light.position -
-                                                      light.plane_light.up +
-                                                      light.plane_light.right,
-                                                  light.plane_light.position +
-                                                      light.plane_light.up +
-                                                      light.plane_light.right,
-                                                  light.plane_light.position +
-                                                      light.plane_light.up -
-                                                      light.plane_light.right};
-                                float solid_angle = LTC::plane_solid_angle(
-                                    N, V, vertex.position, points);
-                                if (NoL > 0.0f && solid_angle > 0.0f) {
-                                  new_job.ray_dir = L;
-                                  new_job.weight = 0.0f;
-                                  new_job.light_id = light_id;
-                                  new_job.depth += 1;
-                                  new_job._depth += 1;
-                                  new_job.color =
-                                      solid_angle / (2.0f * PI) * (1.0f / Kd) *
-                                      (NoL * vec3(albedo) *
-                                       (1.0f - DIELECTRIC_SPECULAR) *
-                                       (1.0f - metalness) * job.color);
-                                  path_tracing_queue.enqueue(new_job);
-                                  // #Debug
-                                  if (path_tracing_camera._grab_path) {
-
-                                    path_tracing_camera.push_debug_line(
-
-                                        new_job.ray_origin,
-                                        new_job.ray_origin + L * 100.0f);
-                                  }
-                                }
-                              }
-                            }
-                          }
-                        }
-                      }
-                    } else {
-                      // #Debug
-                      if (path_tracing_camera._grab_path) {
-                        path_tracing_camera.push_debug_line(
-                            job.ray_origin,
-                            job.ray_origin + job.ray_dir * 1000.0f);
-                      }
-                      if (job.depth == 0) {
-                        path_tracing_image.add_value(
-                            job.pixel_x, job.pixel_y,
-                            vec4(0.5f, 0.5f, 0.5f, job.weight));
-                      } else {
-                        path_tracing_image.add_value(
-                            job.pixel_x, job.pixel_y,
-                            job.weight * env_value(job.ray_dir, job.color));
-                      }
-                    }
-                  }
+                .func = {[this, &shade_stream, &run_timed,
+                          &shade_busy_ns](JobDesc desc) {
+                  run_timed(shade_busy_ns, [&] {
+                    shade_stream(*ray_streams[desc.offset]);
+                  });
                 }},
-                .desc = JobDesc{
-                    .offset = i * jobs_per_item,
-                    .size = std::min(u32(jobs_sofar) - i * jobs_per_item,
-                                     jobs_per_item)}});
+                .desc = JobDesc{.offset = i, .size = ray_streams[i]->size}});
           }
           marl::WaitGroup wg(work_payload.size());
           for (u32 i = 0; i < work_payload.size(); i++) {
@@ -1309,8 +3175,26 @@ struct PT_Manager {
             });
           }
           wg.wait();
+          stats.shade_ms = std::chrono::duration<float, std::milli>(
+                               std::chrono::high_resolution_clock::now() -
+                               shade_begin)
+                               .count();
         }
+        if (use_jobs) {
+          stats.idle_ms = std::max(
+              0.0f, (stats.trace_ms + stats.shade_ms) * f32(worker_count) -
+                        f32(trace_busy_ns + shade_busy_ns) * 1.0e-6f);
+        }
+        for (auto &stream : ray_streams)
+          path_tracing_queue.release_stream(std::move(stream));
+        ray_streams.clear();
       }
+      stats.primary_rays = primary_count;
+      stats.secondary_rays = secondary_count;
+      stats.shadow_rays = shadow_count;
+      stats.avg_path_length =
+          camera_rays ? f32(path_segments) / f32(camera_rays) : 0.0f;
+      stats.rr_terminated = rr_terminated;
     } else
     // Debug path that executes one job per iteration
     {
@@ -1321,45 +3205,22 @@ struct PT_Manager {
         if (jobs_sofar == max_jobs_per_iter)
           break;
         auto job = path_tracing_queue.dequeue();
-        bool col_found = false;
         Collision min_col{.t = 1.0e10f};
-        for (auto &node : scene.scene_nodes) {
-          vec4 new_ray_dir = node.invtransform * vec4(job.ray_dir, 0.0f);
-          vec4 new_ray_origin = node.invtransform * vec4(job.ray_origin, 1.0f);
-          node.ug.iterate(new_ray_dir, new_ray_origin,
-                          [&](std::vector<u32> const &items, float t_max) {
-                            bool any_hit = false;
-                            for (u32 face_id : items) {
-                              auto face = node.indices[face_id];
-                              vec3 v0 = node.positions_flat[face.v0];
-                              vec3 v1 = node.positions_flat[face.v1];
-                              vec3 v2 = node.positions_flat[face.v2];
-                              Collision col = {};
-
-                              if (ray_triangle_test_moller(new_ray_origin,
-                                                           new_ray_dir, v0, v1,
-                                                           v2, col)) {
-                                if (col.t < min_col.t && col.t < t_max) {
-                                  col.mesh_id = node.id;
-                                  col.face_id = face_id;
-                                  min_col = col;
-                                  col_found = any_hit = true;
-                                }
-                              }
-                            }
-
-                            return !any_hit;
-                          });
-        }
+        bool col_found =
+            scene.intersect(job.ray_origin, job.ray_dir, min_col);
         if (col_found) {
-          path_tracing_image.add_value(job.pixel_x, job.pixel_y,
+          path_tracing_image.add_value(job.pixel_x, job.pixel_y, job.sample_id,
                                        vec4(1.0f, 1.0f, 1.0f, 1.0f));
 
         } else {
-          path_tracing_image.add_value(job.pixel_x, job.pixel_y,
+          path_tracing_image.add_value(job.pixel_x, job.pixel_y, job.sample_id,
                                        vec4(0.0f, 0.0f, 0.0f, 1.0f));
         }
       }
     }
+    stats.peak_queue_size = path_tracing_queue.peak_size;
+    if (checkpoint_due() && primary_rays.tile_cursor == 0 &&
+        !path_tracing_queue.has_job())
+      write_checkpoint();
   };
 };
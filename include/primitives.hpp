@@ -138,6 +138,146 @@ struct Image_Raw {
   };
 };
 
+// Shading side copy of an Image_Raw
+// Texels are decoded once to linear 16 bit unorm, stored in 4x4 tiles so a
+// bilinear footprint touches one or two cache lines, with a box filtered
+// mip chain
+struct Shading_Texture {
+  static const u32 TILE_SIZE = 4;
+  struct Texel {
+    uint16_t r, g, b, a;
+  };
+  struct Level {
+    u32 width, height;
+    u32 tiles_x;
+    std::vector<Texel> texels;
+    void init(u32 width, u32 height) {
+      this->width = width;
+      this->height = height;
+      tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+      u32 tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+      texels.resize(tiles_x * tiles_y * TILE_SIZE * TILE_SIZE);
+    }
+    Texel &at(u32 x, u32 y) {
+      u32 tile = (y / TILE_SIZE) * tiles_x + x / TILE_SIZE;
+      return texels[tile * TILE_SIZE * TILE_SIZE +
+                    (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+    }
+    vec4 load(i32 x, i32 y) {
+      // Repeat
+      x %= i32(width);
+      y %= i32(height);
+      if (x < 0)
+        x += width;
+      if (y < 0)
+        y += height;
+      Texel t = at(x, y);
+      return vec4(t.r, t.g, t.b, t.a) * (1.0f / 65535.0f);
+    }
+    vec4 sample(vec2 uv) {
+      vec2 suv = uv * vec2(width, height) - vec2(0.5f);
+      vec2 base = glm::floor(suv);
+      vec2 fract = suv - base;
+      i32 x = i32(base.x), y = i32(base.y);
+      return glm::mix(glm::mix(load(x, y), load(x + 1, y), fract.x),
+                      glm::mix(load(x, y + 1), load(x + 1, y + 1), fract.x),
+                      fract.y);
+    }
+  };
+  std::vector<Level> levels;
+  // 0.5 * log2(texel count of the top level), turns a lod computed for a
+  // unit texture into a mip level
+  f32 lod_bias = 0.0f;
+
+  // Gamma 2.2 like Image_Raw::load, alpha stays linear
+  static uint16_t const *get_srgb_lut() {
+    static uint16_t lut[256] = {};
+    static bool init = [] {
+      ito(256) lut[i] =
+          uint16_t(std::pow(float(i) / 255.0f, 2.2f) * 65535.0f + 0.5f);
+      return true;
+    }();
+    (void)init;
+    return lut;
+  }
+  void init(Image_Raw &image) {
+    levels.clear();
+    u32 width = image.width, height = image.height;
+    lod_bias = 0.5f * std::log2(f32(width) * f32(height));
+    levels.emplace_back();
+    auto &top = levels.back();
+    top.init(width, height);
+    uint16_t const *srgb_lut = get_srgb_lut();
+    auto to_unorm16 = [](f32 x) {
+      return uint16_t(glm::clamp(x, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    };
+    ito(height) {
+      jto(width) {
+        Texel &t = top.at(j, i);
+        switch (image.format) {
+        case vk::Format::eR8G8B8A8Unorm: {
+          u8 const *src = &image.data[(j + i * width) * 4];
+          t = Texel{uint16_t(src[0] * 257u), uint16_t(src[1] * 257u),
+                    uint16_t(src[2] * 257u), uint16_t(src[3] * 257u)};
+          break;
+        }
+        case vk::Format::eR8G8B8A8Srgb: {
+          u8 const *src = &image.data[(j + i * width) * 4];
+          t = Texel{srgb_lut[src[0]], srgb_lut[src[1]], srgb_lut[src[2]],
+                    uint16_t(src[3] * 257u)};
+          break;
+        }
+        default: {
+          // Float images are clamped, they are not expected for materials
+          vec4 v = image.load(uvec2(j, i));
+          t = Texel{to_unorm16(v.r), to_unorm16(v.g), to_unorm16(v.b),
+                    to_unorm16(v.a)};
+        }
+        }
+      }
+    }
+    while (width > 1 || height > 1) {
+      u32 new_width = std::max(1u, width / 2);
+      u32 new_height = std::max(1u, height / 2);
+      Level level;
+      level.init(new_width, new_height);
+      auto &src = levels.back();
+      ito(new_height) {
+        jto(new_width) {
+          u32 x0 = std::min(j * 2, width - 1);
+          u32 x1 = std::min(j * 2 + 1, width - 1);
+          u32 y0 = std::min(i * 2, height - 1);
+          u32 y1 = std::min(i * 2 + 1, height - 1);
+          Texel t[4] = {src.at(x0, y0), src.at(x1, y0), src.at(x0, y1),
+                        src.at(x1, y1)};
+          auto avg = [&](uint16_t Texel::*c) {
+            return uint16_t(
+                (u32(t[0].*c) + u32(t[1].*c) + u32(t[2].*c) + u32(t[3].*c) +
+                 2u) >>
+                2u);
+          };
+          level.at(j, i) = Texel{avg(&Texel::r), avg(&Texel::g),
+                                 avg(&Texel::b), avg(&Texel::a)};
+        }
+      }
+      levels.emplace_back(std::move(level));
+      width = new_width;
+      height = new_height;
+    }
+  }
+  // Trilinear lookup, lod is log2 of the footprint in unit texture space
+  vec4 sample(vec2 uv, f32 lod) {
+    f32 level = glm::clamp(lod + lod_bias, 0.0f, f32(levels.size() - 1));
+    u32 l0 = u32(level);
+    u32 l1 = std::min(l0 + 1, u32(levels.size() - 1));
+    f32 t = level - f32(l0);
+    vec4 v0 = levels[l0].sample(uv);
+    if (t == 0.0f || l0 == l1)
+      return v0;
+    return glm::mix(v0, levels[l1].sample(uv), t);
+  }
+};
+
 struct Vertex_Attribute {
   vk::Format format;
   u32 offset;
@@ -442,7 +582,7 @@ struct PBR_Material {
 struct Transform_Node {
   vec3 offset;
   quat rotation;
-  float scale = 1.0f;
+  vec3 scale = vec3(1.0f);
   mat4 transform_cache = mat4(1.0f);
   std::vector<u32> meshes;
   std::vector<u32> children;
@@ -452,7 +592,7 @@ struct Transform_Node {
   mat4 get_transform() {
     //  return transform;
     return glm::translate(mat4(1.0f), offset) * (mat4)rotation *
-           glm::scale(mat4(1.0f), vec3(scale, scale, scale));
+           glm::scale(mat4(1.0f), scale);
   }
   mat4 get_cofactor() {
     mat4 out{};
@@ -461,6 +601,50 @@ struct Transform_Node {
   }
 };
 
+struct Camera {
+  float phi = M_PI / 2.0f;
+  float theta = M_PI / 2.0f;
+  float distance = 60.0f;
+  float mx = 0.0f, my = 0.0f;
+  vec3 look_at = vec3(0.0f, 0.0f, 0.0f);
+  float aspect = 1.0;
+  float fov = M_PI / 2.0;
+  float znear = 1.0f;
+  float zfar = 10.0e5f;
+  //
+  vec3 pos;
+  mat4 view;
+  mat4 proj;
+  vec3 look;
+  vec3 right;
+  vec3 up;
+  void update(vec2 jitter = vec2(0.0f, 0.0f)) {
+    /*-------------------*/
+    /* Update the camera */
+    /*-------------------*/
+    pos = vec3(sinf(theta) * cosf(phi), cos(theta), sinf(theta) * sinf(phi)) *
+              distance +
+          look_at;
+    look = normalize(look_at - pos);
+    right = normalize(cross(look, vec3(0.0f, 1.0f, 0.0f)));
+    up = normalize(cross(right, look));
+    //    proj = glm::perspective(fov, aspect, znear, zfar);
+    proj = mat4(0.0f);
+    float tanHalfFovy = std::tan(fov * 0.5f);
+
+    proj[0][0] = 1.0f / (aspect * tanHalfFovy);
+    proj[1][1] = 1.0f / (tanHalfFovy);
+    proj[2][2] = zfar / (znear - zfar);
+    proj[2][3] = -1.0f;
+    proj[3][2] = -(zfar * znear) / (zfar - znear);
+
+    proj[2][0] += jitter.x;
+    proj[2][1] += jitter.x;
+    view = glm::lookAt(pos, look_at, vec3(0.0f, 1.0f, 0.0f));
+  }
+  mat4 viewproj() { return proj * view; }
+};
+
 // To make things simple we use one format of meshes
 struct PBR_Model {
   std::vector<Image_Raw> images;
@@ -581,3 +765,20 @@ static void union_aabb(vec3 const &min_a, vec3 const &max_a, vec3 &inout_min_b,
     inout_min_b[i] = std::min(inout_min_b[i], min_a[i]);
   }
 }
+
+// Spreads the lower 10 bits of v so there are 2 zero bits between each
+static u32 expand_bits_10(u32 v) {
+  v &= 0x3ffu;
+  v = (v | (v << 16)) & 0x030000ffu;
+  v = (v | (v << 8)) & 0x0300f00fu;
+  v = (v | (v << 4)) & 0x030c30c3u;
+  v = (v | (v << 2)) & 0x09249249u;
+  return v;
+}
+
+// 30 bit Morton code of a point in the unit cube
+static u32 morton_3d(vec3 p) {
+  p = glm::clamp(p * 1024.0f, vec3(0.0f), vec3(1023.0f));
+  return (expand_bits_10(u32(p.x)) << 2) | (expand_bits_10(u32(p.y)) << 1) |
+         expand_bits_10(u32(p.z));
+}
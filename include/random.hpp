@@ -1,6 +1,7 @@
 #pragma once
 #include "../3rdparty/pcg.hpp"
 #include "glm/glm.hpp"
+#include <vector>
 using namespace glm;
 static constexpr float PI = 3.1415926;
 static constexpr float TWO_PI = 6.2831852;
@@ -119,6 +120,25 @@ static vec3 eval_ggx(vec3 n, vec3 v, vec3 l, float roughness, vec3 F0) {
       D * F * G;
 }
 
+// Solid angle pdf of the direction returned by sample_ggx
+static float pdf_ggx(vec3 n, vec3 v, vec3 l, float roughness) {
+  float alpha = roughness * roughness;
+  float alpha2 = alpha * alpha;
+  vec3 h = normalize(v + l);
+  float NoH = clamp(dot(n, h), 0.0f, 1.0f);
+  float VoH = clamp(dot(v, h), 0.0f, 1.0f);
+  float den = (alpha2 - 1.0f) * NoH * NoH + 1.0f;
+  float D = alpha2 / (PI * den * den);
+  return D * NoH / (4.0f * VoH + 1.0e-6f);
+}
+
+// Power heuristic with beta = 2
+static float mis_weight(float pdf, float other_pdf) {
+  float a = pdf * pdf;
+  float b = other_pdf * other_pdf;
+  return a > 0.0f ? a / (a + b) : 0.0f;
+}
+
 static float FresnelSchlickRoughness(float cosTheta, float F0,
                                      float roughness) {
   return F0 + (std::max((1.f - roughness), F0) - F0) *
@@ -239,6 +259,76 @@ static float get_solid_angle(vec3 a, vec3 b) {
                               cos_C);
 }
 
+// Uniform sampling of the solid angle subtended by a rectangle
+// An Area-Preserving Parametrization for Spherical Rectangles, Urena et al.
+// https://www.arnoldrenderer.com/research/egsr2013_spherical_rectangle.pdf
+struct Spherical_Rect {
+  vec3 o, x, y, z;
+  float z0, z0sq;
+  float x0, y0, y0sq;
+  float x1, y1, y1sq;
+  float b0, b1, b0sq, k;
+  // Solid angle, the pdf of every sample is 1 / S
+  float S;
+  // s is a corner, ex and ey are the orthogonal edges, o is the shading point
+  void init(vec3 s, vec3 ex, vec3 ey, vec3 o) {
+    this->o = o;
+    float exl = length(ex), eyl = length(ey);
+    x = ex / exl;
+    y = ey / eyl;
+    z = cross(x, y);
+    vec3 d = s - o;
+    z0 = dot(d, z);
+    // Flip z to point against the rectangle
+    if (z0 > 0.0f) {
+      z *= -1.0f;
+      z0 *= -1.0f;
+    }
+    z0sq = z0 * z0;
+    x0 = dot(d, x);
+    y0 = dot(d, y);
+    x1 = x0 + exl;
+    y1 = y0 + eyl;
+    y0sq = y0 * y0;
+    y1sq = y1 * y1;
+    vec3 v00 = vec3(x0, y0, z0);
+    vec3 v01 = vec3(x0, y1, z0);
+    vec3 v10 = vec3(x1, y0, z0);
+    vec3 v11 = vec3(x1, y1, z0);
+    // Edge normals
+    vec3 n0 = normalize(cross(v00, v10));
+    vec3 n1 = normalize(cross(v10, v11));
+    vec3 n2 = normalize(cross(v11, v01));
+    vec3 n3 = normalize(cross(v01, v00));
+    // Internal angles
+    float g0 = std::acos(clamp(-dot(n0, n1), -1.0f, 1.0f));
+    float g1 = std::acos(clamp(-dot(n1, n2), -1.0f, 1.0f));
+    float g2 = std::acos(clamp(-dot(n2, n3), -1.0f, 1.0f));
+    float g3 = std::acos(clamp(-dot(n3, n0), -1.0f, 1.0f));
+    b0 = n0.z;
+    b1 = n2.z;
+    b0sq = b0 * b0;
+    k = TWO_PI - g2 - g3;
+    S = g0 + g1 - k;
+  }
+  // Returns a point on the rectangle
+  vec3 sample(vec2 xi) const {
+    float au = xi.x * S + k;
+    float fu = (std::cos(au) * b0 - b1) / std::sin(au);
+    float cu = (fu > 0.0f ? 1.0f : -1.0f) / std::sqrt(fu * fu + b0sq);
+    cu = clamp(cu, -1.0f, 1.0f);
+    float xu = -(cu * z0) / std::sqrt(std::max(1.0f - cu * cu, 1.0e-12f));
+    xu = clamp(xu, x0, x1);
+    float d = std::sqrt(xu * xu + z0sq);
+    float h0 = y0 / std::sqrt(d * d + y0sq);
+    float h1 = y1 / std::sqrt(d * d + y1sq);
+    float hv = h0 + xi.y * (h1 - h0);
+    float hv2 = hv * hv;
+    float yv = hv2 < 1.0f - 1.0e-6f ? (hv * d) / std::sqrt(1.0f - hv2) : y1;
+    return o + xu * x + yv * y + z0 * z;
+  }
+};
+
 // Linearly Transformed Cosines
 ///////////////////////////////
 // Src: https://eheitzresearch.wordpress.com/415-2/
@@ -445,6 +535,132 @@ static vec3 LTC_Evaluate(vec3 N, vec3 V, vec3 P, mat3 Minv, vec3 points[4],
 }
 } // namespace LTC
 
+// Hash based Owen scrambled Sobol (0, 2) sequence
+// Higher dimensions are padded with independently shuffled 2D sets
+// Practical Hash-based Owen Scrambling, Burley 2020
+// http://www.jcgt.org/published/0009/04/01/
+namespace Sobol {
+// https://nullprogram.com/blog/2018/07/31/
+static u32 hash(u32 x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+static u32 hash_combine(u32 seed, u32 v) {
+  return seed ^ (hash(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+static u32 reverse_bits(u32 x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+static u32 laine_karras_permutation(u32 x, u32 seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+static u32 nested_uniform_scramble(u32 x, u32 seed) {
+  return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+// First two Sobol dimensions, no direction number tables needed
+static u32 sobol_0(u32 index) { return reverse_bits(index); }
+static u32 sobol_1(u32 index) {
+  u32 result = 0;
+  for (u32 v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+    if (index & 1u)
+      result ^= v;
+  return result;
+}
+// Maps to [0, 1)
+static float to_unit_float(u32 x) {
+  return float(x >> 8) * (1.0f / 16777216.0f);
+}
+static vec2 get_2d(u32 index, u32 seed) {
+  index = nested_uniform_scramble(index, seed);
+  u32 x = nested_uniform_scramble(sobol_0(index), hash_combine(seed, 0u));
+  u32 y = nested_uniform_scramble(sobol_1(index), hash_combine(seed, 1u));
+  return vec2(to_unit_float(x), to_unit_float(y));
+}
+} // namespace Sobol
+
+// Stateless sampler of one path sample
+// Values only depend on the seed, the sample index and the order of the
+// calls, so it can be created anywhere without synchronization
+struct Path_Sampler {
+  u32 seed;
+  u32 index;
+  // Next 2D dimension
+  u32 dimension;
+  vec2 get_2d() {
+    return Sobol::get_2d(index, Sobol::hash_combine(seed, dimension++));
+  }
+  float get_1d() { return get_2d().x; }
+};
+
+// Walker's alias method, O(1) sampling of a discrete distribution
+// Vose's construction: https://www.keithschwarz.com/darts-dice-coins/
+struct Alias_Table {
+  // Probability to keep the bin rather than jump to its alias
+  std::vector<float> prob;
+  std::vector<u32> alias;
+  // Normalized weights
+  std::vector<float> pdf;
+  bool empty() const { return pdf.empty(); }
+  void build(std::vector<float> const &weights) {
+    u32 n = weights.size();
+    prob.assign(n, 1.0f);
+    alias.resize(n);
+    pdf.assign(n, 0.0f);
+    float sum = 0.0f;
+    for (auto w : weights)
+      sum += w;
+    if (n == 0 || sum <= 0.0f) {
+      prob.clear();
+      alias.clear();
+      pdf.clear();
+      return;
+    }
+    std::vector<float> scaled(n);
+    std::vector<u32> small, large;
+    for (u32 i = 0; i < n; i++) {
+      pdf[i] = weights[i] / sum;
+      scaled[i] = pdf[i] * float(n);
+      alias[i] = i;
+      if (scaled[i] < 1.0f)
+        small.push_back(i);
+      else
+        large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+      u32 s = small.back();
+      small.pop_back();
+      u32 l = large.back();
+      prob[s] = scaled[s];
+      alias[s] = l;
+      scaled[l] -= 1.0f - scaled[s];
+      if (scaled[l] < 1.0f) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // Leftovers are 1 up to rounding
+  }
+  // u0 picks the bin, u1 decides between the bin and its alias
+  u32 sample(float u0, float u1) const {
+    u32 n = prob.size();
+    u32 i = std::min(u32(u0 * float(n)), n - 1);
+    return u1 < prob[i] ? i : alias[i];
+  }
+};
+
 class Random_Factory {
 public:
   // @TODO: Seed
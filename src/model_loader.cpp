@@ -15,6 +15,7 @@
 #include <assimp/pbrmaterial.h>
 
 #include <filesystem>
+#include <fstream>
 
 #include "ltc.hpp"
 
@@ -163,21 +164,46 @@ PBR_Model load_obj_pbr(char const *filename) {
   return pbr_out;
 }
 
-void calculate_dim(const aiScene *scene, aiNode *node, vec3 &min, vec3 &max) {
+// Bounds of the scene in world space
+// Meshes are instanced so the model space bounds of every mesh are computed
+// once and their corners are transformed per node
+void calculate_dim(const aiScene *scene, aiNode *node,
+                   aiMatrix4x4 const &parent,
+                   std::vector<std::pair<vec3, vec3>> &mesh_bounds, vec3 &min,
+                   vec3 &max) {
+  aiMatrix4x4 transform = parent * node->mTransformation;
   for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-    aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-    for (unsigned int i = 0; i < mesh->mNumVertices; ++i) {
-      kto(3) max[k] = std::max(max[k], mesh->mVertices[i][k]);
-      kto(3) min[k] = std::min(min[k], mesh->mVertices[i][k]);
+    auto &bounds = mesh_bounds[node->mMeshes[i]];
+    if (bounds.first.x > bounds.second.x) {
+      aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
+      for (unsigned int i = 0; i < mesh->mNumVertices; ++i) {
+        kto(3) bounds.second[k] =
+            std::max(bounds.second[k], mesh->mVertices[i][k]);
+        kto(3) bounds.first[k] =
+            std::min(bounds.first[k], mesh->mVertices[i][k]);
+      }
+    }
+    if (bounds.first.x > bounds.second.x)
+      continue;
+    ito(8) {
+      aiVector3D corner;
+      jto(3) corner[j] = (i >> j) & 1 ? bounds.second[j] : bounds.first[j];
+      corner = transform * corner;
+      kto(3) max[k] = std::max(max[k], corner[k]);
+      kto(3) min[k] = std::min(min[k], corner[k]);
     }
   }
   for (unsigned int i = 0; i < node->mNumChildren; i++) {
-    calculate_dim(scene, node->mChildren[i], min, max);
+    calculate_dim(scene, node->mChildren[i], transform, mesh_bounds, min,
+                  max);
   }
 }
 
+// mesh_table maps aiMesh ids to PBR_Model mesh ids so that a mesh referenced
+// by several nodes is converted once and instanced
 void traverse_node(PBR_Model &out, aiNode *node, const aiScene *scene,
-                   std::string const &dir, u32 parent_id, float vk) {
+                   std::string const &dir, u32 parent_id, float vk,
+                   std::vector<i32> &mesh_table) {
   Transform_Node tnode{};
   mat4 transform;
   ito(4) {
@@ -186,25 +212,53 @@ void traverse_node(PBR_Model &out, aiNode *node, const aiScene *scene,
   vec3 offset;
   vec3 scale;
 
-  ito(3) {
-    scale[i] =
-        glm::length(vec3(transform[0][i], transform[1][i], transform[2][i]));
-  }
+  ito(3) { scale[i] = glm::length(vec3(transform[i])); }
+  // A rotation can't flip the handedness, mirrored nodes get a negative
+  // scale on x instead
+  if (glm::determinant(mat3(transform)) < 0.0f)
+    scale.x = -scale.x;
 
   offset = vec3(transform[3][0], transform[3][1], transform[3][2]);
 
   mat3 rot_mat;
-
+  u32 degenerate_axes = 0;
   ito(3) {
-    jto(3) { rot_mat[i][j] = transform[i][j] / scale[i]; }
+    if (std::abs(scale[i]) > FLOAT_EPS) {
+      jto(3) { rot_mat[i][j] = transform[i][j] / scale[i]; }
+    } else {
+      rot_mat[i] = vec3(0.0f);
+      degenerate_axes++;
+    }
+  }
+  // Zero scale axes have no direction, complete the frame from the others
+  if (degenerate_axes == 3) {
+    rot_mat = mat3(1.0f);
+  } else if (degenerate_axes == 2) {
+    u32 k = std::abs(scale[0]) > FLOAT_EPS   ? 0
+            : std::abs(scale[1]) > FLOAT_EPS ? 1
+                                             : 2;
+    vec3 up = std::abs(rot_mat[k].y) < 0.999f ? vec3(0.0f, 1.0f, 0.0f)
+                                              : vec3(0.0f, 0.0f, 1.0f);
+    rot_mat[(k + 1) % 3] = glm::normalize(glm::cross(rot_mat[k], up));
+    rot_mat[(k + 2) % 3] = glm::cross(rot_mat[k], rot_mat[(k + 1) % 3]);
+  } else if (degenerate_axes == 1) {
+    ito(3) {
+      if (std::abs(scale[i]) <= FLOAT_EPS)
+        rot_mat[i] = glm::cross(rot_mat[(i + 1) % 3], rot_mat[(i + 2) % 3]);
+    }
   }
   quat rotation(rot_mat);
 
-  //  tnode.offset = offset;
-  //  tnode.rotation = rotation;
-  //    tnode.transform = transform;
+  // Vertices are scaled by vk so the translation has to be too
+  tnode.offset = offset * vk;
+  tnode.rotation = rotation;
+  tnode.scale = scale;
 
   for (unsigned int i = 0; i < node->mNumMeshes; i++) {
+    if (mesh_table[node->mMeshes[i]] >= 0) {
+      tnode.meshes.push_back(u32(mesh_table[node->mMeshes[i]]));
+      continue;
+    }
     aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
     // No support for animated meshes
     ASSERT_PANIC(!mesh->HasBones());
@@ -351,13 +405,14 @@ void traverse_node(PBR_Model &out, aiNode *node, const aiScene *scene,
     };
     out.materials.push_back(out_material);
     out.meshes.push_back(opaque_mesh);
+    mesh_table[node->mMeshes[i]] = i32(out.meshes.size() - 1);
     tnode.meshes.push_back(u32(out.meshes.size() - 1));
   }
   out.nodes.push_back(tnode);
   out.nodes[parent_id].children.push_back(u32(out.nodes.size() - 1));
   for (unsigned int i = 0; i < node->mNumChildren; i++) {
     traverse_node(out, node->mChildren[i], scene, dir,
-                  u32(out.nodes.size() - 1), vk);
+                  u32(out.nodes.size() - 1), vk, mesh_table);
   }
 }
 
@@ -369,9 +424,7 @@ PBR_Model load_gltf_pbr(std::string const &filename) {
   std::filesystem::path dir = p.parent_path();
   const aiScene *scene = importer.ReadFile(
       filename.c_str(),
-      aiProcess_Triangulate |
-          // @TODO: Find out why transforms are not handled correcly otherwise
-          aiProcess_GenSmoothNormals | aiProcess_PreTransformVertices |
+      aiProcess_Triangulate | aiProcess_GenSmoothNormals |
           aiProcess_OptimizeMeshes | aiProcess_CalcTangentSpace |
           aiProcess_FlipUVs);
   if (!scene) {
@@ -380,7 +433,12 @@ PBR_Model load_gltf_pbr(std::string const &filename) {
   }
   vec3 max = vec3(0.0f);
   vec3 min = vec3(0.0f);
-  calculate_dim(scene, scene->mRootNode, min, max);
+  {
+    std::vector<std::pair<vec3, vec3>> mesh_bounds(
+        scene->mNumMeshes, {vec3(FLT_MAX), vec3(-FLT_MAX)});
+    calculate_dim(scene, scene->mRootNode, aiMatrix4x4(), mesh_bounds, min,
+                  max);
+  }
   vec3 max_dims = max - min;
   // @Cleanup
   // Size normalization hack
@@ -388,7 +446,9 @@ PBR_Model load_gltf_pbr(std::string const &filename) {
   float max_dim = std::max(max_dims.x, std::max(max_dims.y, max_dims.z));
   vk = 50.0f / max_dim;
   vec3 avg = (max + min) / 2.0f;
-  traverse_node(out, scene->mRootNode, scene, dir.string(), 0, vk);
+  std::vector<i32> mesh_table(scene->mNumMeshes, -1);
+  traverse_node(out, scene->mRootNode, scene, dir.string(), 0, vk,
+                mesh_table);
 
   out.nodes[0].offset = -avg * vk;
   return out;
@@ -636,7 +696,23 @@ Image_Raw load_image(std::string const &filename, vk::Format format) {
   }
 }
 
-void save_image(std::string const &filename, Image_Raw const &image) {
+bool save_image(std::string const &filename, Image_Raw const &image) {
+  // PFM keeps the float values unclamped
+  if (std::filesystem::path(filename).extension() == ".pfm") {
+    ASSERT_PANIC(image.format == vk::Format::eR32G32B32Sfloat &&
+                 "Unsupported format");
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open())
+      return false;
+    // Negative scale means little endian
+    file << "PF\n" << image.width << " " << image.height << "\n-1.0\n";
+    // Scanlines go from the bottom to the top
+    for (u32 i = image.height; i-- > 0;)
+      file.write((char const *)&image.data[i * image.width * 12],
+                 image.width * 12);
+    file.close();
+    return !file.fail();
+  }
   std::vector<u8> data;
   data.resize(image.width * image.height * 4);
   switch (image.format) {
@@ -661,8 +737,8 @@ void save_image(std::string const &filename, Image_Raw const &image) {
   default:
     ASSERT_PANIC(false && "Unsupported format");
   }
-  stbi_write_png(filename.c_str(), image.width, image.height, STBI_rgb_alpha,
-                 &data[0], image.width * 4);
+  return stbi_write_png(filename.c_str(), image.width, image.height,
+                        STBI_rgb_alpha, &data[0], image.width * 4) != 0;
 }
 
 LTC_Data load_ltc_data() {
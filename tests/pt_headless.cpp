@@ -0,0 +1,301 @@
+// Renders a scene with the CPU path tracer without a window or a Vulkan
+// device and prints the render stats as JSON
+// Usage: pt_headless <scene file> <output.png|output.pfm> [checkpoint]
+// With a checkpoint file the render resumes from it if it is valid and
+// saves its progress there every checkpoint_interval passes
+//
+// Scene file, one statement per line, '#' starts a comment:
+//   model models/sponza/sponza.gltf
+//   env spheremaps/lythwood_field.hdr
+//   resolution 512 512
+//   passes 16
+//   samples_per_pixel 1
+//   max_depth 4
+//   seed 0
+//   accel bvh|ug
+//   pipeline on|off
+//   checkpoint_interval 16
+//   camera <pos x y z> <look at x y z> <fov degrees>
+//   point_light <pos x y z> <power r g b>
+//   dir_light <dir x y z> <power r g b>
+//   plane_light <pos x y z> <up x y z> <right x y z> <power r g b>
+#include "../include/error_handling.hpp"
+#include "../include/model_loader.hpp"
+#include "../include/path_tracing.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+
+struct Headless_Config {
+  std::string model;
+  std::string env;
+  u32 width = 512, height = 512;
+  u32 passes = 16;
+  u32 samples_per_pixel = 1;
+  u32 max_depth = 4;
+  u32 seed = 0;
+  u32 checkpoint_interval = 16;
+  bool pipeline_streams = true;
+  Accel_Type accel_type = Accel_Type::BVH;
+  bool has_camera = false;
+  vec3 camera_pos, camera_look_at;
+  f32 camera_fov = 90.0f;
+  std::vector<Light_Source> lights;
+};
+
+static vec3 read_vec3(std::istream &in) {
+  vec3 v;
+  in >> v.x >> v.y >> v.z;
+  return v;
+}
+
+static bool parse_scene_file(std::string const &filename,
+                             Headless_Config &config) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    std::cerr << "[HEADLESS] Can't open " << filename << "\n";
+    return false;
+  }
+  std::string line;
+  u32 line_id = 0;
+  while (std::getline(file, line)) {
+    line_id++;
+    line = line.substr(0, line.find('#'));
+    std::istringstream in(line);
+    std::string key;
+    if (!(in >> key))
+      continue;
+    if (key == "model") {
+      in >> config.model;
+    } else if (key == "env") {
+      in >> config.env;
+    } else if (key == "resolution") {
+      in >> config.width >> config.height;
+    } else if (key == "passes") {
+      in >> config.passes;
+    } else if (key == "samples_per_pixel") {
+      in >> config.samples_per_pixel;
+    } else if (key == "max_depth") {
+      in >> config.max_depth;
+    } else if (key == "seed") {
+      in >> config.seed;
+    } else if (key == "checkpoint_interval") {
+      in >> config.checkpoint_interval;
+    } else if (key == "accel") {
+      std::string type;
+      in >> type;
+      if (type == "ug")
+        config.accel_type = Accel_Type::UNIFORM_GRID;
+      else if (type == "bvh")
+        config.accel_type = Accel_Type::BVH;
+      else
+        in.setstate(std::ios::failbit);
+    } else if (key == "pipeline") {
+      std::string mode;
+      in >> mode;
+      if (mode == "on")
+        config.pipeline_streams = true;
+      else if (mode == "off")
+        config.pipeline_streams = false;
+      else
+        in.setstate(std::ios::failbit);
+    } else if (key == "camera") {
+      config.has_camera = true;
+      config.camera_pos = read_vec3(in);
+      config.camera_look_at = read_vec3(in);
+      in >> config.camera_fov;
+    } else if (key == "point_light") {
+      Light_Source light{.type = Light_Type::POINT};
+      light.point_light.position = read_vec3(in);
+      light.power = read_vec3(in);
+      config.lights.push_back(light);
+    } else if (key == "dir_light") {
+      Light_Source light{.type = Light_Type::DIRECTIONAL};
+      light.dir_light.direction = glm::normalize(read_vec3(in));
+      light.power = read_vec3(in);
+      config.lights.push_back(light);
+    } else if (key == "plane_light") {
+      Light_Source light{.type = Light_Type::PLANE};
+      light.plane_light.position = read_vec3(in);
+      light.plane_light.up = read_vec3(in);
+      light.plane_light.right = read_vec3(in);
+      light.power = read_vec3(in);
+      config.lights.push_back(light);
+    } else {
+      std::cerr << "[HEADLESS] " << filename << ":" << line_id
+                << ": Unknown statement " << key << "\n";
+      return false;
+    }
+    if (in.fail()) {
+      std::cerr << "[HEADLESS] " << filename << ":" << line_id
+                << ": Malformed " << key << "\n";
+      return false;
+    }
+  }
+  if (config.model.empty()) {
+    std::cerr << "[HEADLESS] " << filename << ": No model\n";
+    return false;
+  }
+  if (!config.width || !config.height || !config.passes ||
+      !config.samples_per_pixel || config.samples_per_pixel > 128) {
+    std::cerr << "[HEADLESS] " << filename << ": Bad sampling settings\n";
+    return false;
+  }
+  return true;
+}
+
+// Quotes a string for the JSON output
+static std::string json_string(std::string const &str) {
+  std::string out = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (u8(c) < 0x20) {
+      char escape[7];
+      snprintf(escape, sizeof(escape), "\\u%04x", u32(u8(c)));
+      out += escape;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+  return out;
+}
+
+static f32 ms_since(std::chrono::high_resolution_clock::time_point begin) {
+  return std::chrono::duration<float, std::milli>(
+             std::chrono::high_resolution_clock::now() - begin)
+      .count();
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3 && argc != 4) {
+    std::cerr << "Usage: " << argv[0]
+              << " <scene file> <output.png|output.pfm> [checkpoint]\n";
+    return 1;
+  }
+  Headless_Config config;
+  if (!parse_scene_file(argv[1], config))
+    return 1;
+  // Binds the marl scheduler used by the parallel scene load
+  PT_Manager pt_manager;
+  pt_manager.samples_per_pixel = config.samples_per_pixel;
+  pt_manager.max_depth = config.max_depth;
+  pt_manager.sampler_seed = config.seed;
+  pt_manager.pipeline_streams = config.pipeline_streams;
+  pt_manager.checkpoint_interval = std::max(1u, config.checkpoint_interval);
+
+  auto load_begin = std::chrono::high_resolution_clock::now();
+  Scene scene;
+  scene.accel_type = config.accel_type;
+  if (config.env.empty())
+    scene.init_black_env();
+  else
+    scene.load_env(config.env);
+  scene.load_model(config.model);
+  for (auto const &light : config.lights)
+    scene.push_light(light);
+  f32 load_ms = ms_since(load_begin);
+
+  Camera camera;
+  camera.aspect = f32(config.width) / config.height;
+  if (config.has_camera) {
+    camera.pos = config.camera_pos;
+    camera.look_at = config.camera_look_at;
+    camera.fov = glm::radians(config.camera_fov);
+    camera.look = glm::normalize(camera.look_at - camera.pos);
+    camera.right =
+        glm::normalize(glm::cross(camera.look, vec3(0.0f, 1.0f, 0.0f)));
+    camera.up = glm::normalize(glm::cross(camera.right, camera.look));
+  } else {
+    // Same default view as the interactive viewer
+    camera.update();
+  }
+
+  // Totals over every iteration of the render
+  u64 primary_rays = 0, secondary_rays = 0, shadow_rays = 0;
+  double generate_ms = 0.0, sort_ms = 0.0, trace_ms = 0.0, shade_ms = 0.0;
+  double idle_ms = 0.0;
+  u32 iterations = 0;
+  auto render_begin = std::chrono::high_resolution_clock::now();
+  // The checkpoint overrides the camera and the sampling settings
+  bool resumed = argc == 4 && pt_manager.resume_path_tracing_state(argv[3]);
+  if (!resumed) {
+    pt_manager.reset_path_tracing_state(camera, config.width, config.height);
+    ito(config.passes - 1) pt_manager.add_primary_rays();
+    if (argc == 4)
+      pt_manager.checkpoint_path = argv[3];
+  }
+  while (pt_manager.has_work()) {
+    pt_manager.path_tracing_iteration(scene);
+    auto const &stats = pt_manager.stats;
+    primary_rays += stats.primary_rays;
+    secondary_rays += stats.secondary_rays;
+    shadow_rays += stats.shadow_rays;
+    generate_ms += stats.generate_ms;
+    sort_ms += stats.sort_ms;
+    trace_ms += stats.trace_ms;
+    shade_ms += stats.shade_ms;
+    idle_ms += stats.idle_ms;
+    iterations++;
+  }
+  f32 render_ms = ms_since(render_begin);
+
+  auto &image = pt_manager.path_tracing_image;
+  Image_Raw out;
+  out.width = image.width;
+  out.height = image.height;
+  out.format = vk::Format::eR32G32B32Sfloat;
+  out.data.resize(out.width * out.height * sizeof(vec3));
+  ito(out.width * out.height) {
+    vec4 pixel = image.data[i];
+    vec3 color = pixel.a < 1.0e-6f ? vec3(0.0f) : vec3(pixel) / pixel.a;
+    memcpy(&out.data[i * sizeof(vec3)], &color, sizeof(vec3));
+  }
+  if (!save_image(argv[2], out)) {
+    std::cerr << "[HEADLESS] Can't write " << argv[2] << "\n";
+    return 1;
+  }
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double render_sec = std::max(double(render_ms) * 1.0e-3, 1.0e-9);
+  // One JSON object so the nightly jobs can diff runs
+  std::cout << "{\n"
+            << "  \"scene\": " << json_string(argv[1]) << ",\n"
+            << "  \"resumed\": " << (resumed ? "true" : "false") << ",\n"
+            << "  \"width\": " << image.width << ",\n"
+            << "  \"height\": " << image.height << ",\n"
+            << "  \"passes\": " << pt_manager.primary_rays.passes_done << ",\n"
+            << "  \"samples_per_pixel\": " << pt_manager.samples_per_pixel
+            << ",\n"
+            << "  \"iterations\": " << iterations << ",\n"
+            << "  \"load_ms\": " << load_ms << ",\n"
+            << "  \"accel_build_ms\": " << scene.accel_build_ms << ",\n"
+            << "  \"render_ms\": " << render_ms << ",\n"
+            << "  \"generate_ms\": " << generate_ms << ",\n"
+            << "  \"sort_ms\": " << sort_ms << ",\n"
+            << "  \"trace_ms\": " << trace_ms << ",\n"
+            << "  \"shade_ms\": " << shade_ms << ",\n"
+            << "  \"idle_ms\": " << idle_ms << ",\n"
+            << "  \"pipeline\": "
+            << (pt_manager.pipeline_streams ? "true" : "false") << ",\n"
+            << "  \"primary_rays\": " << primary_rays << ",\n"
+            << "  \"secondary_rays\": " << secondary_rays << ",\n"
+            << "  \"shadow_rays\": " << shadow_rays << ",\n"
+            << "  \"primary_rays_per_sec\": "
+            << double(primary_rays) / render_sec << ",\n"
+            << "  \"secondary_rays_per_sec\": "
+            << double(secondary_rays) / render_sec << ",\n"
+            << "  \"shadow_rays_per_sec\": "
+            << double(shadow_rays) / render_sec << ",\n"
+            << "  \"peak_rss_kb\": " << usage.ru_maxrss << "\n"
+            << "}\n";
+  return 0;
+}
@@ -97,16 +97,7 @@ TEST(graphics, vulkan_graphics_test_render_graph) try {
   iterate_folder("models/", model_filenames, ".gltf");
   iterate_folder("spheremaps/", env_filenames, ".hdr");
   gizmo_layer.camera.update();
-  // Benchmark
-  //  {
-  //    CPU_timestamp __timestamp;
-  //    pt_manager.reset_path_tracing_state(gizmo_layer.camera, 512, 512);
-  //    while (pt_manager.path_tracing_queue.has_job())
-  //      pt_manager.path_tracing_iteration(scene);
-  //    std::cout << "Time ms:" << __timestamp.end() << "\n";
-  //  }
-  //  exit(0);
-  //
+  // Benchmarks run with pt_headless
 
   struct Path_Tracing_Plane_Push {
     mat4 viewprojmodel;
@@ -122,6 +113,13 @@ TEST(graphics, vulkan_graphics_test_render_graph) try {
   bool display_ug = false;
   bool display_wire = false;
   bool denoise = false;
+  // Path tracer time per frame, 0 runs whole iterations
+  int pt_budget_ms = 8;
+  // Restart the path tracer from the viewer camera when it moves
+  bool pt_follow_camera = false;
+  // Keep the samples that are still valid from the new view
+  bool pt_reproject = true;
+  bool display_heatmap = false;
   bool display_lpv = false;
   bool display_shadow = false;
   gu.set_on_gui([&] {
@@ -190,10 +188,22 @@ TEST(graphics, vulkan_graphics_test_render_graph) try {
       pt_manager.add_primary_rays();
     }
     if (ImGui::Button("Reset Path tracer")) {
-      pt_manager.path_tracing_queue.reset();
+      pt_manager.reset_queue();
     }
     ImGui::InputInt("Samples per pixel", (int *)&pt_manager.samples_per_pixel);
     ImGui::InputInt("Max path depth", (int *)&pt_manager.max_depth);
+    ImGui::Checkbox("Russian roulette", &pt_manager.russian_roulette);
+    ImGui::Checkbox("Env sampling", &pt_manager.env_sampling);
+    ImGui::InputInt("Sampler seed", (int *)&pt_manager.sampler_seed);
+    ImGui::Checkbox("Sample lights", &pt_manager.sample_lights);
+    ImGui::InputInt("Light samples", (int *)&pt_manager.light_samples);
+    ImGui::Checkbox("ISPC shading", &pt_manager.shade_ispc);
+    ImGui::Checkbox("Pipeline trace/shade", &pt_manager.pipeline_streams);
+    ImGui::InputInt("RR min depth", (int *)&pt_manager.rr_min_depth);
+    ImGui::InputInt("Max queue size", (int *)&pt_manager.max_queue_size);
+    ImGui::InputInt("Frame budget ms", &pt_budget_ms);
+    ImGui::Checkbox("Follow camera", &pt_follow_camera);
+    ImGui::Checkbox("Reproject samples", &pt_reproject);
     ImGui::Checkbox("Camera jitter", &gizmo_layer.jitter_on);
     ImGui::Checkbox("Gizmo layer", &display_gizmo_layer);
     ImGui::Checkbox("Denoise", &denoise);
@@ -204,6 +214,18 @@ TEST(graphics, vulkan_graphics_test_render_graph) try {
     ImGui::Checkbox("Display Wire", &display_wire);
     ImGui::Checkbox("Use ISPC", &pt_manager.trace_ispc);
     ImGui::Checkbox("Use MT", &pt_manager.use_jobs);
+    ImGui::Checkbox("Sort rays", &pt_manager.sort_rays);
+    ImGui::Checkbox("Packet tracing", &pt_manager.packet_tracing);
+    ImGui::Checkbox("Adaptive sampling", &pt_manager.adaptive_sampling);
+    ImGui::InputFloat("Adaptive threshold", &pt_manager.adaptive_threshold);
+    ImGui::InputInt("Adaptive ray budget",
+                    (int *)&pt_manager.adaptive_ray_budget);
+    ImGui::Checkbox("Sample heatmap", &display_heatmap);
+    {
+      static char const *accel_types[] = {"Uniform grid", "BVH"};
+      ImGui::Combo("Acceleration structure", (int *)&scene.accel_type,
+                   accel_types, 2);
+    }
     if (ImGui::TreeNode("Scene nodes")) {
       ito(scene.light_sources.size()) scene.light_sources[i].imgui_edit(i);
       ImGui::TreePop();
@@ -255,6 +277,34 @@ TEST(graphics, vulkan_graphics_test_render_graph) try {
     gu.ImGui_Image(images[image_item_current], wsize.x - 2, wsize.x - 2);
     ImGui::End();
     ImGui::Begin("Metrics");
+    ImGui::Text("Traced rays: %i", pt_manager.stats.traced_rays);
+    ImGui::Text("Trace time: %fms", pt_manager.stats.trace_ms);
+    ImGui::Text("Peak queue size: %llu",
+                (unsigned long long)pt_manager.stats.peak_queue_size);
+    ImGui::Text("Sort time: %fms", pt_manager.stats.sort_ms);
+    ImGui::Text("Adaptive pixels: %i", pt_manager.stats.adaptive_pixels);
+    ImGui::Text("Reprojected pixels: %i",
+                pt_manager.stats.reprojected_pixels);
+    ImGui::Text("Avg path length: %f", pt_manager.stats.avg_path_length);
+    ImGui::Text("RR terminated: %i", pt_manager.stats.rr_terminated);
+    ImGui::Text("MRays/sec: %f", pt_manager.stats.rays_per_sec * 1.0e-6f);
+    ImGui::Text("Avg MRays/sec unsorted: %f",
+                pt_manager.stats.avg_rays_per_sec[0] * 1.0e-6f);
+    ImGui::Text("Avg MRays/sec sorted: %f",
+                pt_manager.stats.avg_rays_per_sec[1] * 1.0e-6f);
+    ImGui::Text("Generate/Trace/Shade: %fms %fms %fms",
+                pt_manager.stats.generate_ms, pt_manager.stats.trace_ms,
+                pt_manager.stats.shade_ms);
+    ImGui::Text("Worker idle time: %fms", pt_manager.stats.idle_ms);
+    ImGui::Text("Accel build time: %fms", scene.accel_build_ms);
+    ImGui::Text("Meshes: %i Instances: %i", (int)scene.meshes.size(),
+                (int)scene.scene_nodes.size());
+    if (ImGui::TreeNode("Mesh build times")) {
+      ito(scene.meshes.size()) ImGui::Text(
+          "Mesh %i: %i faces %fms", i, (int)scene.meshes[i].indices.size(),
+          scene.meshes[i].build_ms);
+      ImGui::TreePop();
+    }
     ImGui::End();
     if (ImGui::GetIO().KeysDown[GLFW_KEY_ESCAPE]) {
       std::exit(0);
@@ -396,7 +446,18 @@ TEST(graphics, vulkan_graphics_test_render_graph) try {
     scene.update_transforms();
     pt_manager.update_debug_ray(scene, gizmo_layer.camera.pos,
                                 gizmo_layer.mouse_ray);
-    pt_manager.path_tracing_iteration(scene);
+    if (pt_follow_camera && pt_manager.path_tracing_image.width &&
+        (gizmo_layer.camera.pos != pt_manager.path_tracing_camera.pos ||
+         gizmo_layer.camera.look != pt_manager.path_tracing_camera.look)) {
+      if (pt_reproject)
+        pt_manager.reproject_path_tracing_state(scene, gizmo_layer.camera);
+      else
+        pt_manager.reset_path_tracing_state(gizmo_layer.camera, 512, 512);
+    }
+    if (pt_budget_ms > 0)
+      pt_manager.path_tracing_iteration_budgeted(scene, f32(pt_budget_ms));
+    else
+      pt_manager.path_tracing_iteration(scene);
     u32 spheremap_mip_levels =
         get_mip_levels(scene.spheremap.width, scene.spheremap.height);
     gu.create_compute_pass(
@@ -622,7 +683,11 @@ TEST(graphics, vulkan_graphics_test_render_graph) try {
                       .layers = 1}}},
           [&] {
             void *data = nullptr;
-            if (denoise) {
+            std::vector<vec4> heatmap;
+            if (display_heatmap) {
+              heatmap = pt_manager.path_tracing_image.get_sample_heatmap();
+              data = &heatmap[0];
+            } else if (denoise) {
               pt_manager.path_tracing_image.denoise();
               data = &pt_manager.path_tracing_image.denoised_data[0];
             } else {
@@ -1080,7 +1145,8 @@ TEST(graphics, vulkan_graphics_test_render_graph) try {
               std::vector<vec3> ug_lines;
               for (auto &snode : scene.scene_nodes) {
                 std::vector<vec3> ug_lines_t;
-                snode.ug.fill_lines_render(ug_lines_t);
+                auto &smesh = scene.meshes[snode.mesh_id];
+                smesh.ug.fill_lines_render(ug_lines_t, smesh.packed_ug);
                 for (auto &p : ug_lines_t) {
                   vec4 t = snode.transform * vec4(p, 1.0f);
                   ug_lines.push_back(vec3(t.x, t.y, t.z));
@@ -20,6 +20,7 @@
 #include <chrono>
 #include <cstring>
 #include <filesystem>
+#include <fstream>
 namespace fs = std::filesystem;
 
 #define GLM_ENABLE_EXPERIMENTAL
@@ -47,6 +48,709 @@ TEST(math, solid_angle) {
   { float t = 1.0f / 0.0f; }
 }
 
+// Leaves must hold BVH_Item::id and the Woop test used by
+// Scene::intersect_node must agree with the Moller reference
+TEST(bvh, closest_hit) {
+  Random_Factory frand;
+  std::vector<vec3> positions;
+  std::vector<BVH_Item> items;
+  ito(1000) {
+    vec3 center = frand.rand_unit_cube() * 10.0f;
+    vec3 v0 = center + frand.rand_unit_cube();
+    vec3 v1 = center + frand.rand_unit_cube();
+    vec3 v2 = center + frand.rand_unit_cube();
+    // The id is the offset of the first vertex, not the item index
+    items.push_back(BVH_Item{.min = glm::min(v0, glm::min(v1, v2)),
+                             .max = glm::max(v0, glm::max(v1, v2)),
+                             .id = u32(positions.size())});
+    positions.push_back(v0);
+    positions.push_back(v1);
+    positions.push_back(v2);
+  }
+  BVH bvh;
+  bvh.build(items);
+  auto root = bvh.nodes[0];
+  // Same items, same bounds
+  bvh.refit(items);
+  ASSERT_EQ(root.min, bvh.nodes[0].min);
+  ASSERT_EQ(root.max, bvh.nodes[0].max);
+  u32 hits = 0;
+  ito(1000) {
+    vec3 ray_origin = frand.rand_unit_cube() * 20.0f;
+    vec3 ray_dir = glm::normalize(frand.rand_unit_cube());
+    Collision brute_col{.t = FLT_MAX};
+    jto(items.size()) {
+      Collision col = {};
+      if (ray_triangle_test_moller(ray_origin, ray_dir, positions[j * 3],
+                                   positions[j * 3 + 1], positions[j * 3 + 2],
+                                   col) &&
+          col.t < brute_col.t) {
+        col.face_id = j;
+        brute_col = col;
+      }
+    }
+    Collision bvh_col{.t = FLT_MAX};
+    bvh.iterate(ray_dir, ray_origin,
+                [&](u32 const *ids, u32 count, float &t_max) {
+                  jto(count) {
+                    u32 id = ids[j];
+                    Collision col = {};
+                    if (ray_triangle_test_woop(ray_origin, ray_dir,
+                                               positions[id],
+                                               positions[id + 1],
+                                               positions[id + 2], col) &&
+                        col.t < bvh_col.t) {
+                      col.face_id = id / 3;
+                      bvh_col = col;
+                      t_max = col.t;
+                    }
+                  }
+                  return true;
+                });
+    ASSERT_EQ(brute_col.t == FLT_MAX, bvh_col.t == FLT_MAX);
+    if (brute_col.t == FLT_MAX)
+      continue;
+    hits++;
+    ASSERT_EQ(brute_col.face_id, bvh_col.face_id);
+    ASSERT_NEAR(brute_col.t, bvh_col.t,
+                1.0e-3f * std::max(1.0f, brute_col.t));
+    ASSERT_NEAR(brute_col.u, bvh_col.u, 1.0e-3f);
+    ASSERT_NEAR(brute_col.v, bvh_col.v, 1.0e-3f);
+  }
+  ASSERT_GT(hits, 0u);
+}
+
+// Packet traversal must find the same hits as the per lane traversal
+TEST(bvh, packet_trace) {
+  Random_Factory frand;
+  Raw_Mesh_Opaque raw_mesh;
+  raw_mesh.vertex_stride = sizeof(GLRF_Vertex_Static);
+  ito(1000) {
+    vec3 center = frand.rand_unit_cube() * 10.0f;
+    jto(3) {
+      GLRF_Vertex_Static vertex = {};
+      vertex.position = center + frand.rand_unit_cube();
+      raw_mesh.attributes.insert(raw_mesh.attributes.end(), (u8 *)&vertex,
+                                 (u8 *)&vertex + sizeof(vertex));
+      raw_mesh.indices.push_back(i * 3 + j);
+    }
+  }
+  Scene scene;
+  Scene_Mesh mesh;
+  scene.build_mesh(mesh, raw_mesh);
+  Scene_Node node;
+  node.id = 1;
+  node.mesh_id = 0;
+  node.invtransform = mat4(1.0f);
+  BVH tlas;
+  tlas.build({BVH_Item{.min = mesh.bvh.nodes[0].min,
+                       .max = mesh.bvh.nodes[0].max,
+                       .id = 0}});
+  auto stream = std::make_unique<PT_Manager::Ray_Stream>();
+  // A narrow cone of camera-like rays, the count is not a multiple of the
+  // gang size
+  vec3 ray_origin = vec3(0.0f, 0.0f, -30.0f);
+  ito(1001) {
+    PT_Manager::Path_Tracing_Job job = {};
+    job.ray_origin = ray_origin;
+    job.ray_dir = glm::normalize(vec3(0.0f, 0.0f, 1.0f) +
+                                 frand.rand_unit_cube() * 0.3f);
+    stream->push(job);
+  }
+  // Incoherent rays from inside the mesh, the grid walk takes the per lane
+  // path for those packets
+  ito(1001) {
+    PT_Manager::Path_Tracing_Job job = {};
+    job.ray_origin = frand.rand_unit_cube() * 5.0f;
+    job.ray_dir = glm::normalize(frand.rand_unit_cube() * 2.0f - 1.0f);
+    stream->push(job);
+  }
+  auto rays = stream->get_packed_rays();
+  for (auto accel_type : {Accel_Type::UNIFORM_GRID, Accel_Type::BVH}) {
+    auto instance = ispc_pack_instance(node, mesh, accel_type);
+    std::vector<Collision> expected(stream->size, Collision{.t = FLT_MAX});
+    std::vector<Collision> packet(stream->size, Collision{.t = FLT_MAX});
+    uint count = stream->size;
+    ispc_trace_scene(&tlas.nodes[0], &tlas.ids[0], &instance, &rays,
+                     &expected[0], &count);
+    ispc_trace_scene_packets(&tlas.nodes[0], &tlas.ids[0], &instance, &rays,
+                             &packet[0], &count);
+    u32 hits = 0;
+    ito(count) {
+      ASSERT_EQ(expected[i].mesh_id, packet[i].mesh_id);
+      if (expected[i].mesh_id == 0)
+        continue;
+      hits++;
+      ASSERT_EQ(expected[i].face_id, packet[i].face_id);
+      ASSERT_EQ(expected[i].t, packet[i].t);
+    }
+    ASSERT_GT(hits, 0);
+  }
+}
+
+// pack_items must build the same grid as put() followed by pack()
+TEST(ug, pack_items) {
+  Random_Factory frand;
+  std::vector<vec3> box_min, box_max;
+  vec3 model_min = vec3(FLT_MAX);
+  vec3 model_max = vec3(-FLT_MAX);
+  ito(1000) {
+    vec3 center = frand.rand_unit_cube() * 10.0f;
+    vec3 triangle_min = vec3(FLT_MAX);
+    vec3 triangle_max = vec3(-FLT_MAX);
+    // Mostly small triangles and a few that span many cells
+    float size = i % 50 == 0 ? 4.0f : 0.5f;
+    jto(3) {
+      vec3 v = center + frand.rand_unit_cube() * size;
+      triangle_min = glm::min(triangle_min, v);
+      triangle_max = glm::max(triangle_max, v);
+    }
+    box_min.push_back(triangle_min);
+    box_max.push_back(triangle_max);
+    model_min = glm::min(model_min, triangle_min);
+    model_max = glm::max(model_max, triangle_max);
+  }
+  auto get_box = [&](u32 i, vec3 &pos, vec3 &extent) {
+    pos = (box_min[i] + box_max[i]) * 0.5f;
+    extent = (box_max[i] - box_min[i]) * 0.5f;
+  };
+  UG ug(model_min, model_max, 0.7f);
+  ito(box_min.size()) {
+    vec3 pos, extent;
+    get_box(i, pos, extent);
+    ug.put(pos, extent, i);
+  }
+  Packed_UG expected = ug.pack();
+  Packed_UG packed = ug.pack_items(box_min.size(), get_box);
+  ASSERT_EQ(expected.bin_count, packed.bin_count);
+  ASSERT_EQ(expected.arena_table, packed.arena_table);
+  ASSERT_EQ(expected.ids, packed.ids);
+}
+
+// One triangle instanced by a plain node, a mirrored node and a node that
+// is flattened along z
+TEST(model_loader, mirrored_instance) {
+  auto path = fs::temp_directory_path() / "mirrored_instance.gltf";
+  {
+    std::ofstream file(path);
+    file << R"({
+  "asset": {"version": "2.0"},
+  "scene": 0,
+  "scenes": [{"nodes": [0, 1, 2]}],
+  "nodes": [
+    {"mesh": 0},
+    {"mesh": 0, "matrix": [-2, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 4, 0, 0, 1]},
+    {"mesh": 0, "matrix": [1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 3, 0, 1]}
+  ],
+  "meshes": [{"primitives": [{"attributes": {"POSITION": 0}}]}],
+  "accessors": [{"bufferView": 0, "componentType": 5126, "count": 3,
+                 "type": "VEC3", "min": [0, 0, 0], "max": [1, 1, 0]}],
+  "bufferViews": [{"buffer": 0, "byteLength": 36}],
+  "buffers": [{"byteLength": 36, "uri":
+    "data:application/octet-stream;base64,AAAAAAAAAAAAAAAAAACAPwAAAAAAAAAAAAAAAAAAgD8AAAAA"}]
+})";
+  }
+  PBR_Model model = load_gltf_pbr(path.string());
+  fs::remove(path);
+  // The mesh is converted once
+  ASSERT_EQ(model.meshes.size(), 1u);
+  std::vector<mat4> transforms;
+  for (auto &node : model.nodes) {
+    if (node.meshes.empty())
+      continue;
+    ASSERT_EQ(node.meshes[0], 0u);
+    mat4 transform = node.get_transform();
+    ito(4) jto(4) ASSERT_FALSE(std::isnan(transform[i][j]));
+    transforms.push_back(transform);
+  }
+  ASSERT_EQ(transforms.size(), 3u);
+  // Vertices and offsets are scaled by the loader, the linear part is not
+  mat3 expected[] = {mat3(1.0f), mat3(glm::scale(mat4(1.0f), vec3(-2, 1, 1))),
+                     mat3(glm::scale(mat4(1.0f), vec3(1, 1, 0)))};
+  vec3 expected_dir[] = {vec3(0.0f), vec3(1, 0, 0), vec3(0, 1, 0)};
+  ito(3) {
+    mat3 linear = mat3(transforms[i]);
+    jto(3) kto(3) ASSERT_NEAR(linear[j][k], expected[i][j][k], 1.0e-5f);
+    vec3 offset = vec3(transforms[i][3]);
+    if (i == 0) {
+      ASSERT_LT(glm::length(offset), 1.0e-5f);
+    } else {
+      jto(3) ASSERT_NEAR(glm::normalize(offset)[j], expected_dir[i][j],
+                         1.0e-5f);
+    }
+  }
+  ASSERT_LT(glm::determinant(mat3(transforms[1])), 0.0f);
+}
+
+TEST(math, alias_table) {
+  Random_Factory frand;
+  std::vector<float> weights = {1.0f, 2.0f, 3.0f, 0.0f, 4.0f, 0.5f};
+  Alias_Table table;
+  table.build(weights);
+  std::vector<u32> counts(weights.size());
+  u32 N = 1000000;
+  ito(N) counts[table.sample(frand.rand_unit_float(),
+                             frand.rand_unit_float())]++;
+  ASSERT_EQ(counts[3], 0);
+  ito(weights.size()) {
+    ASSERT_NEAR(table.pdf[i], weights[i] / 10.5f, 1.0e-6f);
+    ASSERT_NEAR(float(counts[i]) / N, table.pdf[i], 1.0e-2f);
+  }
+}
+
+// Scrambling and shuffling must keep the (0, 2)-net property, the first
+// 256 samples of every dimension fall into distinct 16x16 strata
+TEST(math, sobol_net) {
+  ito(4) {
+    Path_Sampler sampler{.seed = Sobol::hash(i), .index = 0, .dimension = 0};
+    jto(3) {
+      std::vector<u32> strata(16 * 16);
+      for (u32 k = 0; k < 256; k++) {
+        sampler.index = k;
+        sampler.dimension = j;
+        vec2 xi = sampler.get_2d();
+        ASSERT_TRUE(xi.x >= 0.0f && xi.x < 1.0f);
+        ASSERT_TRUE(xi.y >= 0.0f && xi.y < 1.0f);
+        strata[u32(xi.x * 16.0f) + u32(xi.y * 16.0f) * 16]++;
+      }
+      for (auto count : strata)
+        ASSERT_EQ(count, 1);
+    }
+  }
+}
+
+// ispc_shade_surfaces must match the scalar reference
+TEST(path_tracing, shade_surfaces) {
+  using Surface_Batch = PT_Manager::Surface_Batch;
+  Random_Factory frand;
+  auto batch = std::make_unique<Surface_Batch>();
+  auto random_vec3 = [&] {
+    return vec3(frand.rand_unit_float(), frand.rand_unit_float(),
+                frand.rand_unit_float());
+  };
+  batch->size = Surface_Batch::CAPACITY - 3;
+  ito(batch->size) {
+    vec3 N = glm::normalize(random_vec3() * 2.0f - 1.0f);
+    vec3 T = glm::normalize(glm::cross(N, random_vec3() * 2.0f - 1.0f));
+    vec3 V = glm::normalize(random_vec3() * 2.0f - 1.0f);
+    if (glm::dot(N, V) < 0.0f)
+      V = -V;
+    Surface_Batch::set(batch->normal, i, N);
+    Surface_Batch::set(batch->tangent, i, T);
+    Surface_Batch::set(batch->binormal, i, glm::cross(N, T));
+    Surface_Batch::set(batch->view, i, V);
+    Surface_Batch::set(batch->albedo, i, random_vec3());
+    Surface_Batch::set(batch->normal_map, i,
+                       vec3(0.25f, 0.25f, 0.5f) +
+                           vec3(0.5f, 0.5f, 0.5f) * random_vec3());
+    batch->roughness[i] = std::max(frand.rand_unit_float(), 1.0e-5f);
+    batch->metalness[i] = frand.rand_unit_float();
+    batch->xi[0][i] = frand.rand_unit_float();
+    batch->xi[1][i] = frand.rand_unit_float();
+    batch->lobe_u[i] = frand.rand_unit_float();
+    Surface_Batch::set(batch->position, i, random_vec3() * 10.0f);
+    Surface_Batch::set(batch->path_color, i, random_vec3());
+    batch->cone_spread[i] = frand.rand_unit_float();
+  }
+  auto reference = std::make_unique<Surface_Batch>(*batch);
+  ito(reference->size) reference->shade_scalar(i);
+  ISPC_Packed_Surfaces packed = batch->get_packed();
+  ispc_shade_surfaces(&packed, &batch->size);
+  auto expect_near = [](vec3 a, vec3 b) {
+    ito(3) ASSERT_NEAR(a[i], b[i], 1.0e-3f * std::max(1.0f, std::abs(b[i])));
+  };
+  u32 flipped = 0;
+  ito(batch->size) {
+    ASSERT_NEAR(batch->ks[i], reference->ks[i], 1.0e-4f);
+    ASSERT_NEAR(batch->nov[i], reference->nov[i], 1.0e-4f);
+    expect_near(Surface_Batch::get(batch->shading_normal, i),
+                Surface_Batch::get(reference->shading_normal, i));
+    expect_near(Surface_Batch::get(batch->f0, i),
+                Surface_Batch::get(reference->f0, i));
+    expect_near(Surface_Batch::get(batch->origin, i),
+                Surface_Batch::get(reference->origin, i));
+    // Lobe choice may flip on rounding at the decision boundaries
+    if (batch->lobe[i] != reference->lobe[i]) {
+      flipped++;
+      continue;
+    }
+    expect_near(Surface_Batch::get(batch->dir, i),
+                Surface_Batch::get(reference->dir, i));
+    expect_near(Surface_Batch::get(batch->throughput, i),
+                Surface_Batch::get(reference->throughput, i));
+    ASSERT_NEAR(batch->pdf[i], reference->pdf[i],
+                1.0e-3f * std::max(1.0f, reference->pdf[i]));
+    expect_near(Surface_Batch::get(batch->color, i),
+                Surface_Batch::get(reference->color, i));
+    ASSERT_NEAR(batch->spread[i], reference->spread[i], 1.0e-4f);
+  }
+  ASSERT_LE(flipped, batch->size / 1000);
+}
+
+// ispc_eval_light_rays must match the scalar reference
+TEST(path_tracing, eval_light_rays) {
+  using Surface_Batch = PT_Manager::Surface_Batch;
+  using Light_Ray_Batch = PT_Manager::Light_Ray_Batch;
+  Random_Factory frand;
+  auto batch = std::make_unique<Surface_Batch>();
+  auto random_vec3 = [&] {
+    return vec3(frand.rand_unit_float(), frand.rand_unit_float(),
+                frand.rand_unit_float());
+  };
+  batch->size = Surface_Batch::CAPACITY;
+  ito(batch->size) {
+    vec3 N = glm::normalize(random_vec3() * 2.0f - 1.0f);
+    vec3 T = glm::normalize(glm::cross(N, random_vec3() * 2.0f - 1.0f));
+    vec3 V = glm::normalize(random_vec3() * 2.0f - 1.0f);
+    if (glm::dot(N, V) < 0.0f)
+      V = -V;
+    Surface_Batch::set(batch->normal, i, N);
+    Surface_Batch::set(batch->tangent, i, T);
+    Surface_Batch::set(batch->binormal, i, glm::cross(N, T));
+    Surface_Batch::set(batch->view, i, V);
+    Surface_Batch::set(batch->albedo, i, random_vec3());
+    Surface_Batch::set(batch->normal_map, i, vec3(0.5f, 0.5f, 1.0f));
+    batch->roughness[i] = std::max(frand.rand_unit_float(), 1.0e-2f);
+    batch->metalness[i] = frand.rand_unit_float();
+    batch->xi[0][i] = frand.rand_unit_float();
+    batch->xi[1][i] = frand.rand_unit_float();
+    batch->lobe_u[i] = frand.rand_unit_float();
+    Surface_Batch::set(batch->position, i, random_vec3() * 10.0f);
+    Surface_Batch::set(batch->path_color, i, random_vec3());
+    batch->cone_spread[i] = 0.0f;
+    batch->shade_scalar(i);
+  }
+  // A few rays of every kind per hit, above the surface like the ones the
+  // shading step spawns
+  auto &rays = batch->light_rays;
+  while (!rays.full()) {
+    u32 i = std::min<u32>(frand.rand_unit_float() * batch->size,
+                          batch->size - 1);
+    if (batch->nov[i] < 1.0e-2f)
+      continue;
+    vec3 N = Surface_Batch::get(batch->shading_normal, i);
+    vec3 L = glm::normalize(random_vec3() * 2.0f - 1.0f);
+    if (glm::dot(N, L) < 1.0e-2f)
+      continue;
+    u32 kind = std::min<u32>(frand.rand_unit_float() * 3.0f, 2);
+    rays.push(i, kind, L, frand.rand_unit_float() * 4.0f,
+              frand.rand_unit_float() + 1.0e-2f, 1, 1.0f);
+  }
+  auto reference = std::make_unique<Surface_Batch>(*batch);
+  ito(rays.size) reference->eval_light_ray_scalar(i);
+  ISPC_Packed_Surfaces packed_surfaces = batch->get_packed();
+  ISPC_Packed_Light_Rays packed = rays.get_packed();
+  ispc_eval_light_rays(&packed_surfaces, &packed, &rays.size);
+  ito(rays.size) {
+    vec3 a = Light_Ray_Batch::get(rays.color, i);
+    vec3 b = Light_Ray_Batch::get(reference->light_rays.color, i);
+    jto(3) ASSERT_NEAR(a[j], b[j], 1.0e-3f * std::max(1.0f, std::abs(b[j])));
+  }
+}
+
+// Open box with a cube in it, lit by every light type and the env
+// Two meshes so that the top level BVH has more than one instance
+static void init_test_scene(Scene &scene) {
+  auto push_quad = [](Raw_Mesh_Opaque &mesh, vec3 center, vec3 right,
+                      vec3 up) {
+    u32 base = mesh.attributes.size() / sizeof(GLRF_Vertex_Static);
+    vec2 uvs[] = {vec2(0.0f, 0.0f), vec2(1.0f, 0.0f), vec2(1.0f, 1.0f),
+                  vec2(0.0f, 1.0f)};
+    ito(4) {
+      GLRF_Vertex_Static vertex;
+      vertex.position = center + right * (uvs[i].x * 2.0f - 1.0f) +
+                        up * (uvs[i].y * 2.0f - 1.0f);
+      vertex.normal = glm::normalize(glm::cross(right, up));
+      vertex.tangent = glm::normalize(right);
+      vertex.binormal = glm::normalize(up);
+      vertex.texcoord = uvs[i];
+      mesh.attributes.insert(mesh.attributes.end(), (u8 *)&vertex,
+                             (u8 *)&vertex + sizeof(vertex));
+    }
+    for (u32 id : {0u, 1u, 2u, 0u, 2u, 3u})
+      mesh.indices.push_back(base + id);
+    mesh.vertex_stride = sizeof(GLRF_Vertex_Static);
+  };
+  auto &model = scene.pbr_model;
+  model = PBR_Model{};
+  model.meshes.resize(2);
+  // Floor, back and left walls facing the inside
+  auto &room = model.meshes[0];
+  push_quad(room, vec3(0.0f, -10.0f, 0.0f), vec3(20.0f, 0.0f, 0.0f),
+            vec3(0.0f, 0.0f, -20.0f));
+  push_quad(room, vec3(0.0f, 5.0f, -20.0f), vec3(20.0f, 0.0f, 0.0f),
+            vec3(0.0f, 15.0f, 0.0f));
+  push_quad(room, vec3(-20.0f, 5.0f, 0.0f), vec3(0.0f, 0.0f, -20.0f),
+            vec3(0.0f, 15.0f, 0.0f));
+  // Unit cube, faces facing out
+  auto &cube = model.meshes[1];
+  vec3 x(1.0f, 0.0f, 0.0f), y(0.0f, 1.0f, 0.0f), z(0.0f, 0.0f, 1.0f);
+  push_quad(cube, x, -z, y);
+  push_quad(cube, -x, z, y);
+  push_quad(cube, y, x, -z);
+  push_quad(cube, -y, x, z);
+  push_quad(cube, z, x, y);
+  push_quad(cube, -z, -x, y);
+  model.materials.resize(2);
+  model.materials[0].albedo_factor = vec4(0.8f, 0.7f, 0.6f, 1.0f);
+  model.materials[0].metal_factor = 0.0f;
+  model.materials[0].roughness_factor = 0.9f;
+  model.materials[1].albedo_factor = vec4(0.9f, 0.9f, 0.9f, 1.0f);
+  model.materials[1].metal_factor = 1.0f;
+  model.materials[1].roughness_factor = 0.3f;
+  model.nodes.resize(2);
+  for (auto &node : model.nodes) {
+    node.offset = vec3(0.0f);
+    node.rotation = quat(1.0f, 0.0f, 0.0f, 0.0f);
+  }
+  model.nodes[0].meshes = {0};
+  model.nodes[0].children = {1};
+  model.nodes[1].meshes = {1};
+  model.nodes[1].offset = vec3(0.0f, -5.0f, 0.0f);
+  model.nodes[1].scale = vec3(5.0f);
+  scene.init_model();
+  // Constant env so that env sampling has something to pick
+  scene.init_black_env();
+  vec3 sky(0.3f, 0.4f, 0.6f);
+  ito(4) memcpy(&scene.spheremap.data[i * sizeof(vec3)], &sky, sizeof(vec3));
+  scene.env_sampler.build(scene.spheremap);
+  Light_Source point{.type = Light_Type::POINT, .power = vec3(400.0f)};
+  point.point_light.position = vec3(0.0f, 15.0f, 10.0f);
+  scene.push_light(point);
+  Light_Source dir{.type = Light_Type::DIRECTIONAL, .power = vec3(0.5f)};
+  dir.dir_light.direction = glm::normalize(vec3(-1.0f, -2.0f, -1.0f));
+  scene.push_light(dir);
+  Light_Source plane{.type = Light_Type::PLANE, .power = vec3(4.0f)};
+  plane.plane_light.position = vec3(0.0f, 14.0f, -5.0f);
+  plane.plane_light.up = vec3(0.0f, 0.0f, 3.0f);
+  plane.plane_light.right = vec3(3.0f, 0.0f, 0.0f);
+  scene.push_light(plane);
+}
+
+// Image and per kind ray counts of a finished render
+struct Test_Render {
+  std::vector<vec4> data;
+  u32 calls = 0;
+  // Summed over the calls, so they only count every step when a call runs
+  // a single step
+  u64 primary_rays = 0;
+  u64 secondary_rays = 0;
+  u64 shadow_rays = 0;
+};
+// Renders the default camera view until the queue is empty
+// setup runs before the first pass, run_call defaults to
+// path_tracing_iteration
+static Test_Render
+render_test_scene(Scene &scene, std::function<void(PT_Manager &)> setup,
+                  std::function<void(PT_Manager &)> run_call = nullptr) {
+  Camera camera;
+  camera.update();
+  auto pt_manager = std::make_unique<PT_Manager>();
+  pt_manager->samples_per_pixel = 4;
+  setup(*pt_manager);
+  pt_manager->reset_path_tracing_state(camera, 48, 48);
+  Test_Render out;
+  while (pt_manager->has_work()) {
+    if (run_call)
+      run_call(*pt_manager);
+    else
+      pt_manager->path_tracing_iteration(scene);
+    out.calls++;
+    out.primary_rays += pt_manager->stats.primary_rays;
+    out.secondary_rays += pt_manager->stats.secondary_rays;
+    out.shadow_rays += pt_manager->stats.shadow_rays;
+  }
+  out.data = pt_manager->path_tracing_image.data;
+  return out;
+}
+
+// Samples only come from the per path sampler and the accumulators are
+// fixed point, so two renders with the same seed must match exactly. A
+// random number generator shared by the workers breaks that
+TEST(path_tracing, deterministic_sampling) {
+  Scene scene;
+  init_test_scene(scene);
+  std::function<void(PT_Manager &)> configs[] = {
+      // BSDF samples MISed with env light samples
+      [](PT_Manager &pt_manager) {
+        pt_manager.env_sampling = true;
+        pt_manager.sample_lights = false;
+      },
+      // One light per shading point picked from the power weighted table
+      [](PT_Manager &pt_manager) {
+        pt_manager.env_sampling = false;
+        pt_manager.sample_lights = true;
+        pt_manager.light_samples = 1;
+      },
+  };
+  for (auto &config : configs) {
+    auto first = render_test_scene(scene, config);
+    auto second = render_test_scene(scene, config);
+    ASSERT_GT(first.secondary_rays, 0u);
+    ASSERT_GT(first.shadow_rays, 0u);
+    ASSERT_EQ(first.data.size(), second.data.size());
+    u32 lit = 0;
+    ito(first.data.size()) {
+      ASSERT_EQ(first.data[i], second.data[i]);
+      if (first.data[i].r > 0.0f)
+        lit++;
+    }
+    ASSERT_GT(lit, 0u);
+  }
+}
+
+// Splitting the work into budgeted steps must not change the image
+// The accumulators are fixed point so the sums don't depend on the order
+TEST(path_tracing, budgeted_iteration) {
+  Scene scene;
+  init_test_scene(scene);
+  // Deep enough for bounces off the cube and the walls
+  auto setup = [](PT_Manager &pt_manager) { pt_manager.max_depth = 4; };
+  auto reference = render_test_scene(scene, setup);
+  // A tiny budget runs one step of one stream per call
+  auto budgeted = render_test_scene(scene, setup, [&](PT_Manager &pt_manager) {
+    pt_manager.path_tracing_iteration_budgeted(scene, 1.0e-3f);
+  });
+  ASSERT_GT(reference.secondary_rays, 0u);
+  ASSERT_GT(reference.shadow_rays, 0u);
+  ASSERT_GT(budgeted.calls, reference.calls);
+  ASSERT_EQ(reference.data.size(), budgeted.data.size());
+  ito(reference.data.size()) {
+    ASSERT_EQ(reference.data[i], budgeted.data[i]);
+    ASSERT_GT(reference.data[i].a, 0.0f);
+  }
+}
+
+// Steps only take the jobs whose rays fit under max_queue_size, so the
+// queue stays bounded and the image does not change
+TEST(path_tracing, queue_cap) {
+  Scene scene;
+  init_test_scene(scene);
+  const u32 cap = 4096;
+  u64 peak = 0;
+  u32 max_spawned = 0;
+  auto run_call = [&](PT_Manager &pt_manager) {
+    pt_manager.path_tracing_iteration(scene);
+    peak = std::max(peak, pt_manager.stats.peak_queue_size);
+    max_spawned = pt_manager.max_spawned_jobs();
+  };
+  auto reference = render_test_scene(
+      scene, [](PT_Manager &pt_manager) { pt_manager.max_depth = 4; },
+      run_call);
+  // Without a binding cap one step shades every camera ray at once
+  ASSERT_GT(peak, u64(cap));
+  peak = 0;
+  auto capped = render_test_scene(
+      scene,
+      [&](PT_Manager &pt_manager) {
+        pt_manager.max_depth = 4;
+        pt_manager.max_queue_size = cap;
+      },
+      run_call);
+  // A full queue still lets one job through
+  ASSERT_LE(peak, u64(cap + max_spawned));
+  ASSERT_GT(capped.calls, reference.calls);
+  ASSERT_EQ(reference.data.size(), capped.data.size());
+  ito(reference.data.size()) ASSERT_EQ(reference.data[i], capped.data[i]);
+}
+
+// A resumed render must continue from the exact accumulator state
+TEST(path_tracing, checkpoint_resume) {
+  std::string path = (fs::temp_directory_path() / "test_6.ptck").string();
+  fs::remove(path);
+  Camera camera;
+  camera.update();
+  std::vector<vec4> expected;
+  {
+    auto pt_manager = std::make_unique<PT_Manager>();
+    pt_manager->reset_path_tracing_state(camera, 17, 9);
+    pt_manager->checkpoint_path = path;
+    auto &image = pt_manager->path_tracing_image;
+    ito(image.width) jto(image.height) image.add_value(
+        i, j, i + j, vec4(f32(i) * 0.5f, f32(j), 1.0f, 1.0f));
+    image.sample_count[5] = 42;
+    pt_manager->path_tracing_camera.halton_counter = 77;
+    pt_manager->write_checkpoint();
+    // The second checkpoint goes to the other slot and becomes current
+    image.add_value(0, 0, 1, vec4(1.0f));
+    pt_manager->path_tracing_camera.halton_counter = 78;
+    pt_manager->write_checkpoint();
+    image.resolve_pending = true;
+    image.resolve();
+    expected = image.data;
+  }
+  auto pt_manager = std::make_unique<PT_Manager>();
+  ASSERT_TRUE(pt_manager->resume_path_tracing_state(path));
+  auto &image = pt_manager->path_tracing_image;
+  ASSERT_EQ(image.width, 17u);
+  ASSERT_EQ(image.height, 9u);
+  ASSERT_EQ(image.sample_count[5], 42u);
+  ASSERT_EQ(pt_manager->path_tracing_camera.halton_counter, 78u);
+  ASSERT_EQ(pt_manager->primary_rays.pending_passes, 1u);
+  ito(expected.size()) ASSERT_EQ(image.data[i], expected[i]);
+  fs::remove(path);
+  ASSERT_FALSE(pt_manager->resume_path_tracing_state(path));
+}
+
+// Samples must follow the surface they were taken on when the camera moves
+TEST(path_tracing, reprojection) {
+  Scene scene;
+  scene.init_black_env();
+  Camera camera;
+  camera.update();
+  auto pt_manager = std::make_unique<PT_Manager>();
+  pt_manager->reset_path_tracing_state(camera, 32, 32);
+  auto &image = pt_manager->path_tracing_image;
+  // Every ray escapes the empty scene, give each pixel its own color
+  ito(image.width) jto(image.height) {
+    image.add_value(i, j, 0, vec4(f32(i), f32(j), 1.0f, 1.0f));
+    image.sample_count[i + j * image.width] = 1;
+  }
+  image.resolve_pending = true;
+  image.resolve();
+  auto expected = image.data;
+  pt_manager->reproject_path_tracing_state(scene, camera);
+  ASSERT_EQ(pt_manager->stats.reprojected_pixels, 32u * 32u);
+  ito(expected.size()) ASSERT_EQ(image.data[i], expected[i]);
+  // Turning the camera shifts the image and drops the pixels that come into
+  // view
+  camera.look = glm::normalize(camera.look + camera.right * 0.1f);
+  camera.right = glm::normalize(glm::cross(camera.look, camera.up));
+  pt_manager->reproject_path_tracing_state(scene, camera);
+  ASSERT_GT(pt_manager->stats.reprojected_pixels, 0u);
+  ASSERT_TRUE(pt_manager->stats.reprojected_pixels < 32u * 32u);
+  ASSERT_EQ(image.sample_count[image.width - 1], 0u);
+  ASSERT_TRUE(image.data[0].r > 0.0f);
+}
+
+// Streaming the streams through trace and shade must not change the image
+// or the amount of work
+TEST(path_tracing, pipelined_streams) {
+  Scene scene;
+  init_test_scene(scene);
+  auto render = [&](bool pipeline_streams, bool sort_rays) {
+    return render_test_scene(scene, [=](PT_Manager &pt_manager) {
+      pt_manager.pipeline_streams = pipeline_streams;
+      pt_manager.sort_rays = sort_rays;
+      pt_manager.max_depth = 4;
+    });
+  };
+  auto reference = render(false, false);
+  ASSERT_GT(reference.secondary_rays, 0u);
+  ASSERT_GT(reference.shadow_rays, 0u);
+  // Sorting also covers the streams the pipeline takes during a step
+  for (bool sort_rays : {false, true}) {
+    auto pipelined = render(true, sort_rays);
+    ASSERT_EQ(reference.primary_rays, pipelined.primary_rays);
+    ASSERT_EQ(reference.secondary_rays, pipelined.secondary_rays);
+    ASSERT_EQ(reference.shadow_rays, pipelined.shadow_rays);
+    ASSERT_EQ(reference.data.size(), pipelined.data.size());
+    // Alpha holds the sample weights so this covers them too
+    ito(reference.data.size())
+        ASSERT_EQ(reference.data[i], pipelined.data[i]);
+  }
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();